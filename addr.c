@@ -0,0 +1,39 @@
+#define _POSIX_C_SOURCE 200809L
+#include <sys/socket.h>
+#include <netdb.h>
+
+static const unsigned char _client_ai[] = { 2, 0, 31, 65, 127, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0 };
+const struct addrinfo client_ai = {
+	.ai_family = AF_INET,
+	.ai_socktype = SOCK_DGRAM,
+	.ai_protocol = 17, /* udp */
+	.ai_addrlen = (socklen_t)sizeof(_client_ai),
+	.ai_addr = (struct sockaddr *)_client_ai
+};
+
+static const unsigned char _server_ai[] = { 2, 0, 31, 66, 127, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0 };
+const struct addrinfo server_ai = {
+	.ai_family = AF_INET,
+	.ai_socktype = SOCK_DGRAM,
+	.ai_protocol = 17, /* udp */
+	.ai_addrlen = (socklen_t)sizeof(_server_ai),
+	.ai_addr = (struct sockaddr *)_server_ai
+};
+
+static const unsigned char _listen_ai[] = { 2, 0, 31, 67, 127, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0 };
+const struct addrinfo listen_ai = {
+	.ai_family = AF_INET,
+	.ai_socktype = SOCK_STREAM,
+	.ai_protocol = 6, /* tcp */
+	.ai_addrlen = (socklen_t)sizeof(_listen_ai),
+	.ai_addr = (struct sockaddr *)_listen_ai
+};
+
+static const unsigned char _connect_ai[] = { 2, 0, 31, 68, 127, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0 };
+const struct addrinfo connect_ai = {
+	.ai_family = AF_INET,
+	.ai_socktype = SOCK_STREAM,
+	.ai_protocol = 6, /* tcp */
+	.ai_addrlen = (socklen_t)sizeof(_connect_ai),
+	.ai_addr = (struct sockaddr *)_connect_ai
+};
@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2019, 2020 Ali Farzanrad <ali_farzanrad@riseup.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#define _POSIX_C_SOURCE	200809L
+
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "conf.h"
+#include "msg.h"
+
+/*
+ * Settings are lines of words, the name first:
+ *
+ *	frequency 100
+ *	server udp 192.0.2.1 8002
+ *	listen tcp 127.0.0.1 2222 1
+ *
+ * The last word of listen and connect is a service, 0 unless given: a
+ * stream accepted on a listener goes to the backends of its service.
+ * Empty lines and everything after # are ignored.
+ */
+
+enum {
+	WordsMax = 5,
+	DatagramMin = 576,
+	DatagramLimit = 65507, /* largest udp payload */
+	HistoryMin = 16,
+	HistoryLimit = 1 << 14, /* seq is 16 bits */
+	DedupMin = 1 << 16,
+	DedupLimit = 1 << 28,
+	SpillLimit = 1 << 29, /* with a window, credit stays below 2^31 */
+	SockBufLimit = 1 << 30,
+	CpuLimit = 1023, /* of a cpu_set_t */
+	FrequencyLimit = 1000,
+	PeerSendMin = 256,
+	WindowLimit = 1 << 30
+};
+
+int		 conf_words(char *, char **);
+long long	 conf_number(const char *, const char *, long long, long long);
+struct addrinfo	*conf_addr(char **, int, int);
+int		 conf_service(char **, int *);
+
+struct conf	 conf = {
+	.openmax = OpenMax,
+	.history = MessageHistory,
+	.frequency = SendFrequency,
+	.resetafter = ResetAfter,
+	.ackfrequency = AckFrequency,
+	.keepalivemin = KeepaliveMin,
+	.keepalivemax = KeepaliveMax,
+	.datagram = DatagramMaxSize,
+	.windowmax = WindowMax,
+	.eject = EjectTime,
+	.sockbuf = SockBufMax,
+	.busypoll = -1,
+	.spilldir = "/var/tmp",
+	.client = &client_ai,
+	.server = &server_ai,
+	.listen = { &listen_ai },
+	.connect = { &connect_ai }
+};
+struct conf	 session;
+struct addrinfo	*connect_last[ServiceMax];
+
+void
+conf_load(const char *const path)
+{
+	FILE		*fp;
+	char		*line = NULL;
+	size_t		 linesize = 0;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+
+	while (getline(&line, &linesize, fp) != -1)
+		conf_set(line);
+
+	if (ferror(fp))
+		err(1, "%s", path);
+
+	free(line);
+	fclose(fp);
+}
+
+void
+conf_set(const char *const setting)
+{
+	char		*line, *word[WordsMax];
+	struct addrinfo	*ai;
+	const char	*name;
+	int		 n, k = 0;
+
+	if ((line = strdup(setting)) == NULL)
+		err(1, "strdup");
+	else if ((n = conf_words(line, word)) == 0) {
+		free(line);
+		return;
+	}
+
+	name = word[0];
+	if (strcmp(name, "listen") == 0 || strcmp(name, "connect") == 0)
+		k = conf_service(word, &n);
+
+	if (strcmp(name, "client") == 0)
+		conf.client = conf_addr(word, n, SOCK_DGRAM);
+	else if (strcmp(name, "server") == 0)
+		conf.server = conf_addr(word, n, SOCK_DGRAM);
+	else if (strcmp(name, "listen") == 0)
+		conf.listen[k] = conf_addr(word, n, SOCK_STREAM);
+	else if (strcmp(name, "udplisten") == 0)
+		conf.udplisten = conf_addr(word, n, SOCK_DGRAM);
+	else if (strcmp(name, "udpconnect") == 0)
+		conf.udpconnect = conf_addr(word, n, SOCK_DGRAM);
+	else if (strcmp(name, "connect") == 0) {
+		/* every one adds backends, the built in one is replaced */
+		ai = conf_addr(word, n, SOCK_STREAM);
+		if (connect_last[k] == NULL)
+			conf.connect[k] = ai;
+		else
+			connect_last[k]->ai_next = ai;
+		for (connect_last[k] = ai; connect_last[k]->ai_next != NULL; )
+			connect_last[k] = connect_last[k]->ai_next;
+	} else if (n != 2)
+		errx(1, "%s: bad setting", name);
+	else if (strcmp(name, "handoff") == 0) {
+#ifdef USE_IO_URING
+		errx(1, "handoff does not work with io_uring");
+#endif
+		if ((conf.handoff = strdup(word[1])) == NULL)
+			err(1, "strdup");
+	} else if (strcmp(name, "spilldir") == 0) {
+		if ((conf.spilldir = strdup(word[1])) == NULL)
+			err(1, "strdup");
+	} else if (strcmp(name, "openmax") == 0)
+		conf.openmax = (int)conf_number(name, word[1], 3, FD_SETSIZE);
+	else if (strcmp(name, "datagram") == 0)
+		conf.datagram = (size_t)conf_number(name, word[1],
+		    DatagramMin, DatagramLimit);
+	else if (strcmp(name, "history") == 0)
+		conf.history = (int)conf_number(name, word[1],
+		    HistoryMin, HistoryLimit);
+	else if (strcmp(name, "frequency") == 0)
+		conf.frequency = (int)conf_number(name, word[1],
+		    2, FrequencyLimit);
+	else if (strcmp(name, "resetafter") == 0)
+		conf.resetafter = (int)conf_number(name, word[1], 1, 3600);
+	else if (strcmp(name, "ackfrequency") == 0)
+		conf.ackfrequency = (int)conf_number(name, word[1], 1, 64);
+	else if (strcmp(name, "keepalivemin") == 0)
+		conf.keepalivemin = (int)conf_number(name, word[1], 1, 3600);
+	else if (strcmp(name, "keepalivemax") == 0)
+		conf.keepalivemax = (int)conf_number(name, word[1], 1, 3600);
+	else if (strcmp(name, "window") == 0)
+		conf.windowinit = (size_t)conf_number(name, word[1],
+		    0, WindowLimit);
+	else if (strcmp(name, "windowmax") == 0)
+		conf.windowmax = (size_t)conf_number(name, word[1],
+		    1, WindowLimit);
+	else if (strcmp(name, "balance") == 0) {
+		if (strcmp(word[1], "streams") == 0)
+			conf.latency = 0;
+		else if (strcmp(word[1], "latency") == 0)
+			conf.latency = 1;
+		else
+			errx(1, "%s: use streams or latency", name);
+	} else if (strcmp(name, "dedup") == 0)
+		conf.dedup = (size_t)conf_number(name, word[1], 0, DedupLimit);
+	else if (strcmp(name, "spill") == 0)
+		conf.spill = (size_t)conf_number(name, word[1], 0, SpillLimit);
+	else if (strcmp(name, "sockbuf") == 0)
+		conf.sockbuf = (size_t)conf_number(name, word[1], 0,
+		    SockBufLimit);
+	else if (strcmp(name, "busypoll") == 0) {
+#ifndef USE_BUSY_POLL
+		errx(1, "busypoll is not built in");
+#endif
+		conf.busypoll = (int)conf_number(name, word[1], -1, CpuLimit);
+	} else if (strcmp(name, "eject") == 0)
+		conf.eject = (int)conf_number(name, word[1], 1, 3600);
+	else
+		errx(1, "%s: unknown setting", name);
+
+	free(line);
+}
+
+void
+conf_check(void)
+{
+	const char	*errstr;
+
+	if (conf.keepalivemin > conf.keepalivemax)
+		errx(1, "keepalivemin is above keepalivemax");
+	else if ((errstr = conf_derive(&conf)) != NULL)
+		errx(1, "%s", errstr);
+
+	session = conf;
+}
+
+const char *
+conf_derive(struct conf *const c)
+{
+	int		 i, listeners = 0;
+
+	for (i = 0; i < ServiceMax; ++i)
+		listeners += c->listen[i] != NULL;
+
+	if (c->history < HistoryMin || c->history > HistoryLimit ||
+	    (c->history & (c->history - 1)) != 0)
+		return "history is not a power of 2";
+	else if (c->datagram < DatagramMin || c->datagram > DatagramLimit)
+		return "datagram is out of range";
+	else if (c->openmax < 2 + c->reserved + listeners +
+	    2 * (c->handoff != NULL) + (c->spill > 0) +
+	    (c->udplisten != NULL) + FlowMax * (c->udpconnect != NULL) ||
+	    c->openmax - 2 > StreamSlots)
+		return "openmax is out of range";
+	else if (c->dedup > DedupLimit || (c->dedup > 0 && c->dedup < DedupMin))
+		return "dedup is out of range";
+	else if (c->spill > SpillLimit)
+		return "spill is out of range";
+
+	/*
+	 * besides the udp socket, what the program keeps and the stream
+	 * listeners, handoff takes a listener and, while it lasts, a
+	 * connection, a spill file one while it is set up, datagrams a
+	 * listener in nstc and a socket for each flow in nstd
+	 */
+	c->peers = c->openmax - 1 - c->reserved - listeners -
+	    2 * (c->handoff != NULL) - (c->spill > 0) -
+	    (c->udplisten != NULL) - FlowMax * (c->udpconnect != NULL);
+	c->masksize = (size_t)c->history >> 4;
+	c->reportsize = ReportFixed + c->masksize;
+	c->reportcount = (int)c->masksize << 3;
+	c->headersize = HeaderFixed + c->reportsize;
+
+	/* 8 random + 8 md5 */
+	if (c->datagram < 16 + c->headersize + ChunkHeaderMax + PeerSendMin)
+		return "datagram is too small for the history";
+
+	c->datasize = c->datagram - 16 - c->headersize;
+	c->peermaxsend = c->datasize - ChunkHeaderMax;
+
+	/* it fits the smallest datagram, both in a reset and resent */
+	c->earlysize = c->headersize > ResetHeaderMax ? c->headersize :
+	    ResetHeaderMax;
+	c->earlysize = c->earlysize < DatagramMin - 16 ?
+	    DatagramMin - 16 - c->earlysize : 0;
+	c->windowmin = 2 * c->peermaxsend;
+	if (c->windowinit == 0)
+		c->windowinit = WindowInit * c->peermaxsend;
+
+	if (c->windowinit < c->windowmin)
+		return "window is too small for the datagram";
+	else if (c->windowinit > c->windowmax || c->windowmax > WindowLimit)
+		return "window is above windowmax";
+
+	c->recvbufmax = 2 * c->windowmax;
+	return NULL;
+}
+
+int
+conf_words(char *line, char **const word)
+{
+	const char	*const space = " \t\r\n";
+	int		 n = 0;
+
+	line[strcspn(line, "#")] = '\0';
+
+	for (;;) {
+		line += strspn(line, space);
+		if (*line == '\0')
+			return n;
+		else if (n == WordsMax)
+			errx(1, "%s: too many words", word[0]);
+
+		word[n++] = line;
+		line += strcspn(line, space);
+		if (*line != '\0')
+			*line++ = '\0';
+	}
+}
+
+long long
+conf_number(const char *const name, const char *const s,
+    const long long min, const long long max)
+{
+	char		*end;
+	long long	 x;
+
+	errno = 0;
+	x = strtoll(s, &end, 10);
+	if (errno != 0 || end == s || *end != '\0' || x < min || x > max)
+		errx(1, "%s: %s is invalid, %lld..%lld", name, s, min, max);
+
+	return x;
+}
+
+struct addrinfo *
+conf_addr(char **const word, const int n, const int socktype)
+{
+	struct addrinfo	 hints, *ai;
+	const char	*type;
+	int		 error;
+
+	if (n != 4)
+		errx(1, "%s: use %s type host port", word[0], word[0]);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = socktype;
+	type = socktype == SOCK_DGRAM ? "udp" : "tcp";
+
+	if (strncmp(word[1], type, 3) != 0)
+		errx(1, "%s: %s is not %s", word[0], word[1], type);
+	else if (strcmp(word[1] + 3, "") == 0)
+		hints.ai_family = AF_INET;
+	else if (strcmp(word[1] + 3, "6") == 0)
+		hints.ai_family = AF_INET6;
+	else
+		errx(1, "%s: bad type %s", word[0], word[1]);
+
+	if ((error = getaddrinfo(word[2], word[3], &hints, &ai)) != 0)
+		errx(1, "%s: getaddrinfo: %s", word[0], gai_strerror(error));
+
+	return ai;
+}
+
+int
+conf_service(char **const word, int *const n)
+{
+	if (*n != 5)
+		return 0;
+
+	*n = 4;
+	return (int)conf_number(word[0], word[4], 0, ServiceMax - 1);
+}
@@ -0,0 +1,58 @@
+enum {
+	ServiceMax = 16 /* port forward mappings, listeners of nstc */
+};
+
+struct conf {
+	int		 openmax;
+	int		 peers; /* openmax less listeners + 1 datagram */
+	int		 history; /* power of 2 */
+	int		 frequency; /* messages per second */
+	int		 resetafter; /* seconds */
+	int		 ackfrequency;
+	int		 keepalivemin;
+	int		 keepalivemax;
+	size_t		 datagram;
+	size_t		 windowinit;
+	size_t		 windowmax;
+	int		 latency; /* balance by connect time, not by streams */
+	int		 eject;
+	size_t		 dedup; /* bytes of each chunk cache, 0 is off */
+	size_t		 spill; /* bytes a stream may queue on disk, 0 is off */
+	size_t		 sockbuf; /* largest socket buffer, 0 leaves them alone */
+	int		 busypoll; /* cpu to spin on, -1 is off */
+	int		 reserved; /* descriptors kept besides, stderr of nstd */
+
+	/* derived by conf_derive */
+	size_t		 masksize;
+	size_t		 reportsize;
+	int		 reportcount;
+	size_t		 headersize;
+	size_t		 datasize;
+	size_t		 peermaxsend;
+	size_t		 earlysize; /* first message, sent with the reset */
+	size_t		 windowmin;
+	size_t		 recvbufmax;
+
+	const struct addrinfo *client, *server;
+	const struct addrinfo *listen[ServiceMax]; /* by service */
+	const struct addrinfo *connect[ServiceMax]; /* backends, all of each */
+	const struct addrinfo *udplisten, *udpconnect; /* datagrams */
+	const char	*handoff; /* unix socket to pass descriptors over */
+	const char	*spilldir;
+};
+
+/* conf_load: read settings from a file, one per line */
+void		 conf_load(const char *);
+
+/* conf_set: apply a single setting, like a line of the file */
+void		 conf_set(const char *);
+
+/* conf_check: check the settings before anything is allocated */
+void		 conf_check(void);
+
+/* conf_derive: check sizes and compute the derived ones */
+const char	*conf_derive(struct conf *);
+
+/* conf is what we are configured with, session is agreed with the peer */
+extern struct conf
+	conf, session;
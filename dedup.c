@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2019, 2020 Ali Farzanrad <ali_farzanrad@riseup.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#define _POSIX_C_SOURCE	200809L
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msg.h"
+#include "dedup.h"
+
+/*
+ * Stream data is cut where a rolling hash of the last 64 bytes has its
+ * top bits clear, so equal content is cut the same way wherever it is.
+ * Encoded data is a list of segments, each a varint tag: a literal of
+ * length tag >> 2, which is remembered if the tag says so, or a
+ * reference to the chunk remembered tag >> 2 chunks ago.
+ *
+ * Both ends remember the same chunks in the same order: literals are
+ * learned once a whole message is built, or processed, which is in
+ * sequence order.  A message only refers to chunks learned before it.
+ */
+
+enum {
+	DedupSlots = 1 << 14, /* chunks remembered at most, power of 2 */
+	DedupTable = 1 << 15, /* power of 2 */
+	CutMin = 256,
+	CutMax = 4096,
+	CutWindow = 64, /* bytes the rolling hash depends on */
+	CutBits = 10 /* a kilobyte past CutMin on average */
+};
+
+enum Segment {
+	SegRaw = 0,
+	SegCached = 1,
+	SegRef = 2
+};
+
+struct entry {
+	uint64_t	 pos;
+	uint32_t	 size;
+	uint32_t	 hash;
+};
+
+/* a ring of bytes, chunks are dropped oldest first */
+struct cache {
+	uint8_t		*store;
+	size_t		 size;
+	uint64_t	 pos; /* bytes stored so far */
+	uint32_t	 next; /* index of the next chunk */
+	struct entry	*entries; /* DedupSlots */
+};
+
+size_t		 dedup_cut(const uint8_t *, size_t, int *);
+int		 dedup_find(const uint8_t *, size_t, uint32_t *);
+const uint8_t	*dedup_segment(const uint8_t *, const uint8_t *,
+		    enum Segment *, uint32_t *);
+const struct entry *dedup_entry(const struct cache *, uint32_t);
+void		 dedup_put(struct cache *, const uint8_t *, size_t, uint32_t);
+void		 dedup_get(const struct cache *, const struct entry *,
+		    uint8_t *);
+uint32_t	 dedup_hash(const uint8_t *, size_t);
+
+struct cache	 caches[2];
+uint32_t	*table; /* hash of a chunk we sent to its index */
+uint64_t	 gear[256];
+
+int
+dedup_init(const size_t size)
+{
+	uint64_t	 x = 0;
+	int		 i;
+
+	for (i = 0; i < 2; ++i)
+		if ((caches[i].store = malloc(size)) == NULL ||
+		    (caches[i].entries = calloc(DedupSlots,
+		    sizeof(struct entry))) == NULL)
+			return -1;
+
+	if ((table = calloc(DedupTable, sizeof(*table))) == NULL)
+		return -1;
+
+	/* splitmix64, any fixed table does */
+	for (i = 0; i < 256; ++i) {
+		uint64_t	 z = (x += 0x9e3779b97f4a7c15ULL);
+
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+
+	dedup_reset(size);
+	return 0;
+}
+
+void
+dedup_reset(const size_t size)
+{
+	int		 i;
+
+	for (i = 0; i < 2; ++i) {
+		caches[i].size = size;
+		caches[i].pos = 0;
+		caches[i].next = 0;
+	}
+
+	if (table != NULL)
+		memset(table, 0, DedupTable * sizeof(*table));
+}
+
+size_t
+dedup_encode(const uint8_t *const src, size_t *const size, const int more,
+    uint8_t *const dst, const size_t room)
+{
+	const struct cache *const c = &caches[DedupOut];
+	const size_t	 avail = *size;
+	size_t		 off = 0, w = 0, len;
+	uint32_t	 index, tag;
+	int		 whole;
+
+	while (off < avail && w < room) {
+		len = dedup_cut(src + off, avail - off, &whole);
+
+		/* an unfinished chunk waits for the rest of it */
+		if (!whole && more && off > 0)
+			break;
+
+		if (whole && dedup_find(src + off, len, &index)) {
+			tag = (c->next - index) << 2 | SegRef;
+			if (w + msg_varintsize(tag) > room)
+				break;
+
+			w += msg_putvarint(dst + w, tag);
+			off += len;
+			continue;
+		}
+
+		tag = (uint32_t)len << 2 | (whole ? SegCached : SegRaw);
+		if (w + msg_varintsize(tag) + len > room) {
+			/* what fits is sent as is */
+			if (room - w <= 3)
+				break;
+
+			len = room - w - 3 < len ? room - w - 3 : len;
+			tag = (uint32_t)len << 2 | SegRaw;
+		}
+
+		w += msg_putvarint(dst + w, tag);
+		memcpy(dst + w, src + off, len);
+		w += len;
+		off += len;
+	}
+
+	*size = off;
+	return w;
+}
+
+ssize_t
+dedup_size(const uint8_t *p, const size_t size)
+{
+	const struct cache *const c = &caches[DedupIn];
+	const uint8_t	*const end = p + size;
+	const struct entry *e;
+	enum Segment	 seg;
+	uint32_t	 x;
+	ssize_t		 n = 0;
+
+	if (c->size == 0)
+		return -1;
+
+	while (p != end) {
+		if ((p = dedup_segment(p, end, &seg, &x)) == NULL)
+			return -1;
+		else if (seg != SegRef)
+			n += x;
+		else if ((e = dedup_entry(c, c->next - x)) == NULL)
+			return -1;
+		else
+			n += e->size;
+	}
+
+	return n;
+}
+
+void
+dedup_decode(const uint8_t *p, const size_t size, uint8_t *dst)
+{
+	const struct cache *const c = &caches[DedupIn];
+	const uint8_t	*const end = p + size;
+	const struct entry *e;
+	enum Segment	 seg;
+	uint32_t	 x;
+
+	while (p != end && (p = dedup_segment(p, end, &seg, &x)) != NULL) {
+		if (seg == SegRef) {
+			e = dedup_entry(c, c->next - x);
+			dedup_get(c, e, dst);
+			dst += e->size;
+		} else {
+			memcpy(dst, p - x, x);
+			dst += x;
+		}
+	}
+}
+
+void
+dedup_learn(const int which, const uint8_t *p, const size_t size)
+{
+	struct cache	*const c = &caches[which];
+	const uint8_t	*const end = p + size;
+	enum Segment	 seg;
+	uint32_t	 x, hash;
+
+	if (c->size == 0)
+		return;
+
+	while (p != end && (p = dedup_segment(p, end, &seg, &x)) != NULL) {
+		if (seg != SegCached)
+			continue;
+
+		/* only what we send is looked up */
+		hash = which == DedupOut ? dedup_hash(p - x, x) : 0;
+		if (which == DedupOut)
+			table[hash & (DedupTable - 1)] = c->next;
+		dedup_put(c, p - x, x, hash);
+	}
+}
+
+int
+dedup_save(FILE *const fp)
+{
+	int		 i;
+
+	for (i = 0; i < 2; ++i) {
+		const struct cache *const c = &caches[i];
+
+		fwrite(&c->pos, sizeof(c->pos), 1, fp);
+		fwrite(&c->next, sizeof(c->next), 1, fp);
+		fwrite(c->entries, sizeof(struct entry), DedupSlots, fp);
+		fwrite(c->store, 1, c->size, fp);
+	}
+
+	fwrite(table, sizeof(*table), DedupTable, fp);
+	return ferror(fp) ? -1 : 0;
+}
+
+int
+dedup_load(FILE *const fp)
+{
+	int		 i;
+
+	for (i = 0; i < 2; ++i) {
+		struct cache	*const c = &caches[i];
+
+		if (fread(&c->pos, sizeof(c->pos), 1, fp) != 1 ||
+		    fread(&c->next, sizeof(c->next), 1, fp) != 1 ||
+		    fread(c->entries, sizeof(struct entry), DedupSlots,
+		    fp) != DedupSlots ||
+		    fread(c->store, 1, c->size, fp) != c->size)
+			return -1;
+	}
+
+	if (fread(table, sizeof(*table), DedupTable, fp) != DedupTable)
+		return -1;
+
+	return 0;
+}
+
+size_t
+dedup_cut(const uint8_t *const src, const size_t n, int *const whole)
+{
+	uint64_t	 h = 0;
+	size_t		 i;
+
+	/* the hash is warmed up, the cut does not depend on the start */
+	for (i = CutMin - CutWindow; i < n && i < CutMax; ++i) {
+		h = (h << 1) + gear[src[i]];
+		if (i >= CutMin && h >> (64 - CutBits) == 0) {
+			*whole = 1;
+			return i + 1;
+		}
+	}
+
+	*whole = i == CutMax;
+	return i < n ? i : n;
+}
+
+int
+dedup_find(const uint8_t *const src, const size_t len, uint32_t *const index)
+{
+	const struct cache *const c = &caches[DedupOut];
+	const uint32_t	 hash = dedup_hash(src, len);
+	const struct entry *e;
+	size_t		 off, first;
+
+	*index = table[hash & (DedupTable - 1)];
+	if ((e = dedup_entry(c, *index)) == NULL || e->hash != hash ||
+	    e->size != len)
+		return 0;
+
+	/* a hash is not proof, the bytes are compared */
+	off = (size_t)(e->pos % c->size);
+	first = c->size - off < len ? c->size - off : len;
+	return memcmp(c->store + off, src, first) == 0 &&
+	    memcmp(c->store, src + first, len - first) == 0;
+}
+
+const uint8_t *
+dedup_segment(const uint8_t *p, const uint8_t *const end,
+    enum Segment *const seg, uint32_t *const x)
+{
+	uint32_t	 tag;
+
+	if ((p = msg_getvarint(p, end, &tag)) == NULL)
+		return NULL;
+
+	*seg = (enum Segment)(tag & 3);
+	*x = tag >> 2;
+	if (*seg == SegRef)
+		return p;
+	else if (*seg > SegRef || (size_t)(end - p) < *x)
+		return NULL;
+
+	/* a literal is returned past its bytes */
+	return p + *x;
+}
+
+const struct entry *
+dedup_entry(const struct cache *const c, const uint32_t index)
+{
+	const struct entry *const e = &c->entries[index & (DedupSlots - 1)];
+
+	/* it must be among the last chunks, and its bytes still there */
+	if (c->next - index - 1 >= DedupSlots || c->pos - e->pos > c->size)
+		return NULL;
+
+	return e;
+}
+
+void
+dedup_put(struct cache *const c, const uint8_t *const src, const size_t len,
+    const uint32_t hash)
+{
+	struct entry	*const e = &c->entries[c->next & (DedupSlots - 1)];
+	const size_t	 off = (size_t)(c->pos % c->size);
+	const size_t	 first = c->size - off < len ? c->size - off : len;
+
+	memcpy(c->store + off, src, first);
+	memcpy(c->store, src + first, len - first);
+	e->pos = c->pos;
+	e->size = (uint32_t)len;
+	e->hash = hash;
+	c->pos += len;
+	++c->next;
+}
+
+void
+dedup_get(const struct cache *const c, const struct entry *const e,
+    uint8_t *const dst)
+{
+	const size_t	 off = (size_t)(e->pos % c->size);
+	const size_t	 first = c->size - off < e->size ? c->size - off :
+			    e->size;
+
+	memcpy(dst, c->store + off, first);
+	memcpy(dst + first, c->store, e->size - first);
+}
+
+uint32_t
+dedup_hash(const uint8_t *const src, const size_t len)
+{
+	uint32_t	 h = 2166136261U;
+	size_t		 i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; ++i)
+		h = (h ^ src[i]) * 16777619U;
+
+	return h;
+}
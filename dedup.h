@@ -0,0 +1,29 @@
+enum {
+	DedupIn = 0,
+	DedupOut = 1
+};
+
+/* dedup_init: allocate both chunk caches, each of the given size */
+int		 dedup_init(size_t);
+
+/* dedup_reset: empty both caches, which use the agreed size from now */
+void		 dedup_reset(size_t);
+
+/* dedup_encode: encode stream data as literals and cache references */
+size_t		 dedup_encode(const uint8_t *, size_t *, int, uint8_t *,
+		    size_t);
+
+/* dedup_size: size of encoded data once decoded, -1 if it is bad */
+ssize_t		 dedup_size(const uint8_t *, size_t);
+
+/* dedup_decode: decode data which dedup_size found good */
+void		 dedup_decode(const uint8_t *, size_t, uint8_t *);
+
+/* dedup_learn: add the cached literals of encoded data to a cache */
+void		 dedup_learn(int, const uint8_t *, size_t);
+
+/* dedup_save: write both caches for handoff */
+int		 dedup_save(FILE *);
+
+/* dedup_load: read both caches of the previous process */
+int		 dedup_load(FILE *);
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2019, 2020 Ali Farzanrad <ali_farzanrad@riseup.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#define _POSIX_C_SOURCE	200809L
+
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "conf.h"
+#include "msg.h"
+#include "dgram.h"
+
+/*
+ * A flow is a local sender of nstc, named by an id in the tunnel.  nstd
+ * gives each flow a socket connected to udpconnect, so the answers find
+ * their way back.  Both ends keep the last FlowMax flows; the one used
+ * longest ago makes room for a new one.
+ */
+
+struct flow {
+	uint32_t	 id; /* 0 is unused */
+	uint32_t	 used;
+	int		 s; /* nstd: connected to udpconnect */
+	socklen_t	 addrlen;
+	struct sockaddr_storage addr; /* nstc: the local sender */
+};
+
+struct flow	*dgram_flow(uint32_t, const struct sockaddr_storage *,
+		    socklen_t);
+struct flow	*dgram_oldest(void);
+
+struct flow	 flows[FlowMax];
+uint32_t	 lastflow, lastused;
+uint8_t		 dgrambuf[1 << 16]; /* any udp payload */
+int		 dgram_s = -1;
+
+int
+dgram_listen(void)
+{
+	const struct addrinfo *const ai = conf.udplisten;
+
+	if ((dgram_s = socket(ai->ai_family, ai->ai_socktype,
+	    ai->ai_protocol)) == -1)
+		return -1;
+	else if (bind(dgram_s, ai->ai_addr, ai->ai_addrlen) == -1) {
+		close(dgram_s);
+		dgram_s = -1;
+		return -1;
+	}
+
+	return dgram_s;
+}
+
+void
+dgram_fdset(fd_set *const fds)
+{
+	int		 i;
+
+	if (dgram_s != -1)
+		FD_SET(dgram_s, fds);
+
+	for (i = 0; i < FlowMax; ++i)
+		if (flows[i].id != 0 && flows[i].s != -1)
+			FD_SET(flows[i].s, fds);
+}
+
+void
+dgram_recv(const fd_set *const fds, const int s,
+    const struct addrinfo *const to)
+{
+	struct sockaddr_storage addr;
+	struct flow	*f;
+	socklen_t	 addrlen = sizeof(addr);
+	ssize_t		 n;
+	int		 i;
+
+	if (dgram_s != -1 && FD_ISSET(dgram_s, fds) &&
+	    (n = recvfrom(dgram_s, dgrambuf, sizeof(dgrambuf), 0,
+	    (struct sockaddr *)&addr, &addrlen)) != -1 &&
+	    (f = dgram_flow(0, &addr, addrlen)) != NULL)
+		msg_senddgram(s, f->id, dgrambuf, (size_t)n, to);
+
+	for (i = 0; i < FlowMax; ++i) {
+		f = &flows[i];
+		if (f->id == 0 || f->s == -1 || !FD_ISSET(f->s, fds))
+			continue;
+
+		/* a refused one is reported here, there is nobody to tell */
+		if ((n = recv(f->s, dgrambuf, sizeof(dgrambuf), 0)) != -1) {
+			f->used = ++lastused;
+			msg_senddgram(s, f->id, dgrambuf, (size_t)n, to);
+		}
+	}
+}
+
+void
+dgram_deliver(const uint32_t id, const uint8_t *const data, const size_t size)
+{
+	struct flow	*f;
+
+	if (id == 0 || (dgram_s == -1 && conf.udpconnect == NULL) ||
+	    (f = dgram_flow(id, NULL, 0)) == NULL)
+		return;
+
+	if (dgram_s != -1)
+		sendto(dgram_s, data, size, 0, (struct sockaddr *)&f->addr,
+		    f->addrlen);
+	else
+		send(f->s, data, size, 0);
+}
+
+struct flow *
+dgram_flow(const uint32_t id, const struct sockaddr_storage *const addr,
+    const socklen_t addrlen)
+{
+	const struct addrinfo *const ai = conf.udpconnect;
+	struct flow	*f;
+	int		 i;
+
+	for (i = 0; i < FlowMax; ++i) {
+		f = &flows[i];
+		if (f->id != 0 && (addr != NULL ? f->addrlen == addrlen &&
+		    memcmp(&f->addr, addr, addrlen) == 0 : f->id == id)) {
+			f->used = ++lastused;
+			return f;
+		}
+	}
+
+	/* nstc names new senders, nstd follows the names it is given */
+	if (addr == NULL && dgram_s != -1)
+		return NULL;
+
+	f = dgram_oldest();
+	if (f->id != 0 && f->s != -1)
+		close(f->s);
+
+	memset(f, 0, sizeof(*f));
+	f->s = -1;
+	if (addr != NULL) {
+		if (++lastflow == 0)
+			++lastflow;
+		f->id = lastflow;
+		f->addrlen = addrlen;
+		memcpy(&f->addr, addr, addrlen);
+	} else if ((f->s = socket(ai->ai_family, ai->ai_socktype,
+	    ai->ai_protocol)) == -1)
+		return NULL;
+	else if (connect(f->s, ai->ai_addr, ai->ai_addrlen) == -1) {
+		close(f->s);
+		f->s = -1;
+		return NULL;
+	} else
+		f->id = id;
+
+	f->used = ++lastused;
+	return f;
+}
+
+struct flow *
+dgram_oldest(void)
+{
+	struct flow	*oldest = &flows[0];
+	int		 i;
+
+	for (i = 0; i < FlowMax; ++i)
+		if (flows[i].id == 0)
+			return &flows[i];
+		else if (lastused - flows[i].used > lastused - oldest->used)
+			oldest = &flows[i];
+
+	return oldest;
+}
@@ -0,0 +1,14 @@
+/* dgram_listen: open the local port nstc forwards datagrams from */
+int		 dgram_listen(void);
+
+/* dgram_fdset: watch the sockets datagrams come from */
+void		 dgram_fdset(fd_set *);
+
+/* dgram_recv: pass what came on local sockets through the tunnel */
+void		 dgram_recv(const fd_set *, int, const struct addrinfo *);
+
+/* dgram_deliver: pass a datagram of the tunnel on to its flow */
+void		 dgram_deliver(uint32_t, const uint8_t *, size_t);
+
+/* the listener of nstc, -1 unless udplisten is set */
+extern int	 dgram_s;
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2019, 2020 Ali Farzanrad <ali_farzanrad@riseup.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#define _POSIX_C_SOURCE	200809L
+
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "conf.h"
+#include "msg.h"
+#include "dgram.h"
+#include "handoff.h"
+
+/*
+ * The new process connects to the old one, which sends its sockets
+ * one per message, each tagged with what it is, then the session state
+ * as written by msg_save.  Datagram flows of nstd are not passed, they
+ * start over.  The old process exits once the new one says
+ * it has loaded everything, so the peer never sees a reset.
+ */
+
+enum {
+	TagUdp = -1,
+	TagEnd = -3,
+	TagDgram = -4, /* the datagram listener of nstc */
+	TagListen = -16, /* less the service, the stream listeners of nstc */
+	HandoffTimeout = 5 /* seconds */
+};
+
+int		 handoff_connect(const char *);
+int		 handoff_sendfd(int, int32_t, int);
+int		 handoff_recvfd(int, int32_t *);
+void		 handoff_timeout(int);
+
+int
+handoff_listen(const char *const path)
+{
+	struct sockaddr_un addr;
+	int		 s;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(s, 1) == -1) {
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+int
+handoff_take(const char *const path, int *const udp_s, int *const listen_s,
+    struct peer *const peers)
+{
+	FILE		*fp;
+	int32_t		 tag;
+	int		 s, fd, k, ok;
+
+	if ((s = handoff_connect(path)) == -1)
+		return 0;
+
+	*udp_s = -1;
+	for (k = 0; listen_s != NULL && k < ServiceMax; ++k)
+		listen_s[k] = -1;
+
+	while ((fd = handoff_recvfd(s, &tag)) != -1) {
+		if (tag == TagUdp)
+			*udp_s = fd;
+		else if (listen_s != NULL && tag <= TagListen &&
+		    tag > TagListen - ServiceMax)
+			listen_s[TagListen - tag] = fd;
+		else if (tag == TagDgram)
+			dgram_s = fd;
+		else if (tag >= 0 && tag < conf.peers)
+			peers[tag].s = fd;
+		else
+			close(fd);
+	}
+
+	if (tag != TagEnd || *udp_s == -1 || (fp = fdopen(s, "r")) == NULL) {
+		close(s);
+		return -1;
+	}
+
+	/* the old process exits on our word, then the sockets are ours */
+	ok = msg_load(fp, peers) == 0;
+	if (write(s, ok ? "y" : "n", 1) != 1)
+		ok = 0;
+
+	fclose(fp);
+	return ok ? 1 : -1;
+}
+
+int
+handoff_give(const int l, const int udp_s, const int *const listen_s,
+    const struct peer *const peers)
+{
+	struct sigaction sa, osa;
+	FILE		*fp;
+	char		 reply = 'n';
+	int		 s, i, ok = 0;
+
+	if ((s = accept(l, NULL, NULL)) == -1)
+		return 0;
+
+	/* a dead taker must not kill or hang us */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, &osa);
+	handoff_timeout(s);
+
+	if (handoff_sendfd(s, TagUdp, udp_s) == -1 ||
+	    (dgram_s != -1 && handoff_sendfd(s, TagDgram, dgram_s) == -1))
+		goto done;
+
+	for (i = 0; listen_s != NULL && i < ServiceMax; ++i)
+		if (listen_s[i] != -1 &&
+		    handoff_sendfd(s, TagListen - i, listen_s[i]) == -1)
+			goto done;
+
+	for (i = 0; i < conf.peers; ++i)
+		if (peers[i].s != -1 && handoff_sendfd(s, i, peers[i].s) == -1)
+			goto done;
+
+	if (handoff_sendfd(s, TagEnd, -1) == -1 ||
+	    (fp = fdopen(s, "w")) == NULL)
+		goto done;
+
+	if (msg_save(fp, peers) == 0 && read(s, &reply, 1) == 1)
+		ok = reply == 'y';
+
+	sigaction(SIGPIPE, &osa, NULL);
+	fclose(fp);
+	return ok;
+
+done:
+	sigaction(SIGPIPE, &osa, NULL);
+	close(s);
+	return 0;
+}
+
+int
+handoff_connect(const char *const path)
+{
+	struct sockaddr_un addr;
+	int		 s;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	else if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(s);
+		return -1;
+	}
+
+	handoff_timeout(s);
+	return s;
+}
+
+int
+handoff_sendfd(const int s, int32_t tag, const int fd)
+{
+	union {
+		struct cmsghdr	 hdr;
+		char		 buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct msghdr	 msg;
+	struct iovec	 iov;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &tag;
+	iov.iov_len = sizeof(tag);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (fd != -1) {
+		memset(&cmsg, 0, sizeof(cmsg));
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = sizeof(cmsg.buf);
+		cmsg.hdr.cmsg_level = SOL_SOCKET;
+		cmsg.hdr.cmsg_type = SCM_RIGHTS;
+		cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(&cmsg.hdr), &fd, sizeof(int));
+	}
+
+	return sendmsg(s, &msg, 0) == (ssize_t)sizeof(tag) ? 0 : -1;
+}
+
+int
+handoff_recvfd(const int s, int32_t *const tag)
+{
+	union {
+		struct cmsghdr	 hdr;
+		char		 buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct msghdr	 msg;
+	struct cmsghdr	*c;
+	struct iovec	 iov;
+	int		 fd = -1;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = tag;
+	iov.iov_len = sizeof(*tag);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+
+	/* anything but the end tag without a descriptor is an error */
+	if (recvmsg(s, &msg, MSG_WAITALL) != (ssize_t)sizeof(*tag)) {
+		*tag = TagEnd - 1;
+		return -1;
+	}
+
+	for (c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c))
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(c), sizeof(int));
+
+	return fd;
+}
+
+void
+handoff_timeout(const int s)
+{
+	struct timeval	 tv;
+
+	tv.tv_sec = HandoffTimeout;
+	tv.tv_usec = 0;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
@@ -0,0 +1,8 @@
+/* handoff_listen: listen for the next process at path */
+int		 handoff_listen(const char *);
+
+/* handoff_take: take sockets and state from a running process, if any */
+int		 handoff_take(const char *, int *, int *, struct peer *);
+
+/* handoff_give: pass sockets and state to the connecting process */
+int		 handoff_give(int, int, const int *, const struct peer *);
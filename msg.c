@@ -19,68 +19,242 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
 #include <md5.h>
 #include <netdb.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
-#include "msg.h"
+#ifdef USE_TXTIME
+#include <linux/net_tstamp.h>
+#endif
 
-#define IN_HISTORY(seq)		(&ihist[(seq) & (MessageHistory - 1)])
-#define OUT_HISTORY(seq)	(&ohist[(seq) & (MessageHistory - 1)])
+#include "conf.h"
+#include "msg.h"
+#include "dedup.h"
+#include "dgram.h"
+#include "spill.h"
+#include "tune.h"
+#include "uring.h"
+#include "worker.h"
+
+#if defined(USE_ECN) && defined(USE_IO_URING)
+#error "USE_ECN does not work with USE_IO_URING"
+#endif
+
+#define IN_HISTORY(seq)		(&ihist[(seq) & (session.history - 1)])
+#define OUT_HISTORY(seq)	(&ohist[(seq) & (session.history - 1)])
 #define DIFF16(x, y)		((0x10000 + (x) - (y)) & 0xffff)
+#define DIFF32(x, y)		((uint32_t)((x) - (y)))
+#define SLAB_SIZE(c)		((c) < SlabClasses - 1 ? (size_t)SlabMin << 2 * (c) \
+				    : (conf.datasize + 7) & ~(size_t)7)
+#define RING_WORDS(n)		(((size_t)(n) + 63) >> 6)
+#define LOW_BITS(n)		((n) >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << (n)) - 1)
+#define ACTIVE(peer)		(!(peer)->free && (peer)->id >= StreamSlots)
 
 typedef int	 seq_t;
 
+enum {
+	SlabClasses = 5, /* 64, 256, 1024, 4096, MessageDataMaxSize */
+	SlabMin = 64,
+	SlabObjects = 16,
+	Second = 1000 * 1000 * 1000,
+	StrikeMax = 64, /* epochs of accepted resets */
+	SnapshotVersion = 10
+};
+
+/* history keeps metadata only, payloads live in slabs */
 struct msg {
-	char		 delivered;
+	int		 slab;
 	seq_t		 lasttry;
 	seq_t		 seq;
-	struct {
-		char		 opened;
-		char		 closed;
-		char		 blocked;
-		size_t		 size;
-	} peer[PeersMax];
-	uint8_t		 data[MessageDataMaxSize];
+	size_t		 size;
+	long long	 sent; /* of the first try, 0 once resent */
+	uint8_t		*data;
+};
+
+struct chunk {
+	uint32_t	 id;
+	uint32_t	 offset; /* of the data in the stream */
+	int		 flags;
+	int		 service;
+	size_t		 size;
+	const uint8_t	*data;
 };
 
-size_t		 msg_sendlimit(const struct peer *);
+enum Msg	 msg_parse(const uint8_t *, size_t, struct peer *);
+enum Msg	 msg_control(const uint8_t *, size_t, struct peer *);
+const uint8_t	*msg_report(const uint8_t *, const uint8_t *, struct peer *);
+size_t		 msg_putreport(uint8_t *, size_t, const struct peer *);
+const uint8_t	*msg_credit(const uint8_t *, const uint8_t *, struct peer *);
+size_t		 msg_putcredit(uint8_t *, size_t, const struct peer *);
+size_t		 msg_creditsize(const struct peer *);
+const uint8_t	*msg_getchunk(const uint8_t *, const uint8_t *,
+		    struct chunk *);
+struct peer	*msg_stream(struct peer *, uint32_t);
+ssize_t		 msg_chunksize(const struct peer *, const struct chunk *);
+void		 msg_append(struct peer *, const struct chunk *, size_t);
+void		 msg_bypass(struct peer *);
+void		 msg_autotune(struct peer *);
+int		 msg_creditdue(const struct peer *);
+size_t		 msg_sendable(const struct peer *);
+int		 msg_pending(const struct peer *);
+int		 msg_urgent(const struct peer *);
+int		 msg_idle(const struct peer *);
+void		 msg_congestion(seq_t, uint8_t, int);
+void		 msg_agree(struct peer *);
+void		 msg_fit(void);
+int		 msg_strike(uint32_t);
+void		 msg_early(const uint8_t *, const uint8_t *);
+void		 msg_probe(int);
+int		 msg_samepath(const struct sockaddr_storage *,
+		    const struct sockaddr *);
+void		 msg_moveto(const struct sockaddr_storage *);
+void		 msg_put(FILE *, uint32_t);
+uint32_t	 msg_get(FILE *);
+void		 msg_putmsg(FILE *, const struct msg *);
+int		 msg_getmsg(FILE *, struct msg *);
+void		 msg_sendidle(int, const struct peer *, const struct addrinfo *);
+void		 msg_sendhello(int, struct peer *, const struct addrinfo *);
+size_t		 msg_fill(uint8_t *, size_t, struct peer *);
+int		 msg_pace(int);
+long long	 msg_elapsed(const struct timespec *);
+size_t		 msg_sendlimit(const struct peer *, size_t);
 void		 msg_sendmsg(int, struct msg *, enum Msg,
-		    const struct addrinfo *);
+		    const struct peer *, const struct addrinfo *);
+void		 msg_deliver(struct msg *);
+void		 msg_sample(const struct msg *);
+int		 msg_ack(seq_t, int, uint64_t);
+int		 msg_bit(const uint64_t *, seq_t);
+void		 msg_setbit(uint64_t *, seq_t, int);
+uint64_t	 msg_bits(const uint64_t *, seq_t, int);
+uint8_t		*msg_alloc(size_t, int *);
+void		 msg_free(struct msg *);
+int		 msg_slabgrow(int);
 
 const uint8_t	 psk[] = { 1, 2, 3, 4, 5, 6, 7, 8 };
 
 seq_t		 iseq, oseq, useq;
-struct msg	 ihist[MessageHistory];
-struct msg	 ohist[MessageHistory];
-struct timespec	 last_sendtime;
+uint32_t	 epoch, pepoch;
+int		 cstart, sstart;
+int		 unacked, ackdue, keepalive;
+int		 handshake;
+int		 resyncs; /* sent in this round, they back off */
+int		 txtime;
+int		 urgent; /* the message opens or closes a stream */
+uint32_t	 strikes[StrikeMax];
+unsigned	 strike;
+uint8_t		 cemarks, rcemarks;
+size_t		 budget;
+size_t		 dgramtaken; /* of the budget, in this tick */
+seq_t		 recover = -1;
+struct conf	 pconf;
+struct msg	*ihist, *ohist;
+uint64_t	*ibits; /* of the history, received and not processed yet */
+uint64_t	*obits; /* of the history, sent and not acked yet */
+uint8_t		*inbuf, *outbuf, *databuf, *dedupbuf;
+void		*slab_free[SlabClasses];
+struct timespec	 last_sendtime, last_frametime, started, probed, dgramtime;
+struct timespec	 resynctime; /* of the first resync of the round */
+struct sockaddr_storage source, candidate_addr;
+struct addrinfo	 candidate, *path;
+uint8_t		 challenge[ProbeSize], response[ProbeSize];
+int		 current; /* the datagram being parsed is of this session */
+int		 ahead; /* a message came, maybe past a missing one */
+
+struct peer *
+msg_init(void)
+{
+	struct peer	*peers;
+	int		 i;
+
+	pconf = session = conf;
+	budget = session.datasize;
+	keepalive = conf.keepalivemin;
+	clock_gettime(CLOCK_MONOTONIC, &started);
+
+	/* the history is never longer than ours, whatever is agreed */
+	if ((ihist = calloc((size_t)conf.history, sizeof(*ihist))) == NULL ||
+	    (ohist = calloc((size_t)conf.history, sizeof(*ohist))) == NULL ||
+	    (ibits = calloc(RING_WORDS(conf.history), sizeof(*ibits))) == NULL ||
+	    (obits = calloc(RING_WORDS(conf.history), sizeof(*obits))) == NULL ||
+	    (inbuf = malloc(conf.datagram + MD5_DIGEST_LENGTH)) == NULL ||
+	    (outbuf = malloc(conf.datagram + MD5_DIGEST_LENGTH)) == NULL ||
+	    (databuf = malloc(conf.datasize)) == NULL ||
+	    (peers = calloc((size_t)conf.peers, sizeof(*peers))) == NULL)
+		return NULL;
+	else if (conf.dedup > 0 && (dedup_init(conf.dedup) == -1 ||
+	    (dedupbuf = malloc(conf.datasize)) == NULL))
+		return NULL;
+
+	for (i = 0; i < conf.history; ++i)
+		ihist[i].seq = ohist[i].seq = -1;
+
+	for (i = 0; i < conf.peers; ++i) {
+		if ((peers[i].send.buf = malloc(conf.peermaxsend)) == NULL)
+			return NULL;
+		peers[i].s = -1;
+	}
+
+	return peers;
+}
 
 enum Msg
-msg_recv(const int s)
+msg_recv(const int s, struct peer *const peers)
 {
-	const uint32_t	 curtime = (uint32_t)time(NULL);
-	unsigned char	 buf[DatagramMaxSize + MD5_DIGEST_LENGTH];
-	size_t		 i, size, datasize;
+#ifdef USE_THREADS
+	enum Msg	 type = Msg_Bad, t;
+	const uint8_t	*frame;
+	size_t		 size;
+	int		 ce;
+
+	/* a burst is opened in parallel, but parsed in order */
+	worker_recv(s);
+	while ((frame = worker_next(&size, &ce, &source)) != NULL) {
+		cemarks += (uint8_t)ce;
+		t = msg_parse(frame, size, peers);
+		msg_probe(s);
+		if (type == Msg_Bad || (t != Msg_Bad && (type == Msg_OK ||
+		    type == Msg_Ack || type == Msg_Datagram)))
+			type = t;
+	}
+
+	return type;
+#else
+	enum Msg	 type;
 	ssize_t		 nr;
-	MD5_CTX		 md5_ctx;
-	uint8_t		 digest[MD5_DIGEST_LENGTH];
-	uint32_t	 msgtime, timediff;
-	seq_t		 msgseq, rnext;
-	uint8_t		*rmask;
-	struct msg	*msg;
-	int		 p;
+	int		 ce;
 
-	if ((nr = recv(s, buf, sizeof(buf), 0)) == -1)
+	if ((nr = msg_recvce(s, inbuf, conf.datagram + 1, 0, &ce,
+	    &source)) == -1)
 		return Msg_Bad;
-
-	size = (size_t)nr;
-	if (size < 16 || size > DatagramMaxSize)
+	else if (!msg_open(inbuf, (size_t)nr))
 		return Msg_Bad;
 
+	/* only authentic datagrams count, the mark is not authenticated */
+	cemarks += (uint8_t)ce;
+	type = msg_parse(inbuf, (size_t)nr, peers);
+	msg_probe(s);
+	return type;
+#endif
+}
+
+int
+msg_open(uint8_t *const buf, const size_t size)
+{
+	size_t		 i;
+	MD5_CTX		 md5_ctx;
+	uint8_t		 digest[MD5_DIGEST_LENGTH];
+
+	if (size < 16 || size > conf.datagram)
+		return 0;
+
 	MD5Init(&md5_ctx);
 	MD5Update(&md5_ctx, buf + 2, 6);
 
@@ -102,9 +276,54 @@ msg_recv(const int s)
 
 	for (i = 0; i < 8; ++i)
 		if (buf[i + 8] != digest[i])
-			return Msg_Bad;
+			return 0;
+
+	return 1;
+}
+
+void
+msg_seal(uint8_t *const buf, const size_t size)
+{
+	size_t		 i;
+	MD5_CTX		 md5_ctx;
+	uint8_t		 digest[MD5_DIGEST_LENGTH];
+
+	MD5Init(&md5_ctx);
+	MD5Update(&md5_ctx, buf + 2, 6);
+	MD5Update(&md5_ctx, psk, sizeof(psk));
+	MD5Update(&md5_ctx, buf + 16, size - 16);
+	MD5Final(digest, &md5_ctx);
+
+	for (i = 0; i < 8; ++i)
+		buf[i + 8] = digest[i];
+
+	MD5Init(&md5_ctx);
+	MD5Update(&md5_ctx, buf + 2, 6);
+
+	for (i = 16; i < size; i += MD5_DIGEST_LENGTH) {
+		int		 j;
+
+		MD5Update(&md5_ctx, psk, sizeof(psk));
+		MD5Final(digest, &md5_ctx);
+
+		for (j = 0; j < MD5_DIGEST_LENGTH; ++j)
+			buf[i + j] ^= digest[j];
+	}
+}
+
+enum Msg
+msg_parse(const uint8_t *const buf, const size_t size,
+    struct peer *const peers)
+{
+	const uint32_t	 curtime = (uint32_t)time(NULL);
+	const uint8_t	*data, *p, *q, *end;
+	size_t		 i = 16;
+	uint32_t	 msgtime, timediff, cid, flow;
+	seq_t		 msgseq;
+	struct msg	*msg;
+	struct chunk	 chunk;
 
-	i = 16;
+	current = 0;
 	msgtime = buf[i++];
 	msgtime = (msgtime << 8) + buf[i++];
 	msgtime = (msgtime << 8) + buf[i++];
@@ -114,66 +333,78 @@ msg_recv(const int s)
 	if ((timediff & 0x80000000) != 0)
 		timediff = ~timediff + 1;
 
-	if ((timediff & 0xffffffff) > TimeDiffMax)
-		return Msg_Bad;
-	else if (i == size - 1)
-		switch (buf[i]) {
-		case Msg_Reset:
-		case Msg_Reset_OK:
-			return (enum Msg)buf[i];
-		default:
-			return Msg_Bad;
-		}
-
-	msgseq = buf[i++];
-	msgseq = (msgseq << 8) + buf[i++];
-	if (DIFF16(msgseq, iseq) >= MessageHistory)
+	if ((timediff & 0xffffffff) > TimeDiffMax || i == size)
 		return Msg_Bad;
-
-	if ((msg = IN_HISTORY(msgseq))->seq == msgseq)
+	else if (buf[i] != Msg_OK && buf[i] != Msg_Ack &&
+	    buf[i] != Msg_Datagram)
+		return msg_control(buf + i, size - i, peers);
+	else if (handshake || size < 16 + (buf[i] == Msg_OK ?
+	    session.headersize : buf[i] == Msg_Ack ?
+	    1 + 4 + 4 + session.reportsize : 1 + 4 + 4 + 1))
+		/*
+		 * type, time and connection id, then a report or a flow
+		 * id; reports follow the agreed sizes, they wait for them
+		 */
 		return Msg_Bad;
 
-	msg->seq = msgseq;
-	rnext = ((seq_t)buf[i] << 8) + buf[i + 1];
-	rmask = buf + i + 2;
-	i += ReportSize;
-	datasize = 0;
-
-	for (p = 0; p < PeersMax; ++p) {
-		size_t		 x = buf[i++];
+	/* the session is named by our epoch, not by the address */
+	cid = buf[i + 1];
+	cid = (cid << 8) + buf[i + 2];
+	cid = (cid << 8) + buf[i + 3];
+	cid = (cid << 8) + buf[i + 4];
+	end = buf + size;
 
-		msg->peer[p].opened = (x & 128) != 0;
-		x = ((x & 127) << 8) + buf[i++];
-		datasize += msg->peer[p].size = x / 3;
-		x = (x % 3);
-		msg->peer[p].closed = x > 1;
-		msg->peer[p].blocked = x > 0;
+	if (cid != epoch)
+		return Msg_Bad;
+	else if (buf[i] == Msg_Datagram) {
+		/* a flow id, then the datagram as it came, no padding */
+		if ((p = msg_getvarint(buf + i + 5, end, &flow)) == NULL)
+			return Msg_Bad;
+		current = 1;
+		tune_count(TuneIn, size);
+		dgram_deliver(flow, p, (size_t)(end - p));
+		return Msg_Datagram;
+	} else if (buf[i] == Msg_Ack) {
+		if (msg_report(buf + i + 5, end, peers) == NULL)
+			return Msg_Bad;
+		current = 1;
+		return Msg_Ack;
 	}
 
-	if (size < i + datasize) {
-		msg->seq = -1;
+	msgseq = buf[i + 5];
+	msgseq = (msgseq << 8) + buf[i + 6];
+
+	if ((data = msg_report(buf + i + 7, end, peers)) == NULL)
 		return Msg_Bad;
-	}
 
-	memcpy(msg->data, buf + i, datasize);
+	current = 1;
 
-	for (p = 0; p < MessageHistory; ++p) {
-		struct msg	*const m = &ohist[p];
-		const seq_t	 diff = DIFF16(rnext, m->seq);
+	/* even a duplicate must be acked, our last ack may be lost */
+	++unacked;
+	keepalive = conf.keepalivemin;
 
-		if (m->seq >= 0 && 0 < diff && diff <= MessageHistory)
-			m->delivered = 1;
-	}
+	if (DIFF16(msgseq, iseq) >= session.history)
+		return Msg_Bad;
+	else if ((msg = IN_HISTORY(msgseq))->seq == msgseq)
+		return Msg_Bad;
 
-	for (p = 0; p < ReportCount; ++p) {
-		const uint8_t	 bit = 1 << (7 - (p & 7));
-		const seq_t	 seq = (rnext + p + 1) & 0xffff;
-		struct msg	*const m = OUT_HISTORY(seq);
+	/* chunks are followed by zero padding */
+	for (p = data; (q = msg_getchunk(p, end, &chunk)) != NULL; p = q)
+		;
 
-		if ((rmask[p >> 3] & bit) && m->seq == seq)
-			m->delivered = 1;
-	}
+	if (p != end && *p != 0)
+		return Msg_Bad;
+
+	msg_free(msg);
+	msg->size = (size_t)(p - data);
+	if ((msg->data = msg_alloc(msg->size, &msg->slab)) == NULL)
+		return Msg_Bad;
 
+	msg->seq = msgseq;
+	msg_setbit(ibits, msgseq, 1);
+	memcpy(msg->data, data, msg->size);
+	tune_count(TuneIn, size);
+	ahead = 1;
 	return Msg_OK;
 }
 
@@ -181,37 +412,79 @@ int
 msg_process(struct peer *const peers)
 {
 	struct msg	*const msg = IN_HISTORY(iseq);
-	const uint8_t	*data = msg->data;
-	int		 i;
-
-	if (msg->seq != iseq)
+	const uint8_t	*const end = msg->data + msg->size;
+	const uint8_t	*p;
+	struct peer	*peer;
+	struct chunk	 chunk;
+	ssize_t		 n;
+
+	if (msg->seq != iseq) {
+		/* streams with nothing in the missing message go on */
+		if (ahead)
+			msg_bypass(peers);
+		ahead = 0;
 		return 0;
+	}
 
-	for (i = 0; i < PeersMax; data += msg->peer[i++].size) {
-		size_t		 off, size;
-
-		if (msg->peer[i].opened) {
-			peers[i].recv.open = 1;
-			peers[i].recv.close = 0;
-			peers[i].recv.off = 0;
-			peers[i].recv.size = 0;
+	for (p = msg->data; (p = msg_getchunk(p, end, &chunk)) != NULL; ) {
+		if ((peer = msg_stream(peers, chunk.id)) == NULL)
+			continue;
+
+		if ((chunk.flags & ChunkOpen) && peer->id != chunk.id) {
+			/* a new stream replaces whatever was in this slot */
+			if (peer->s != -1)
+				close(peer->s);
+
+			spill_drop(peer);
+			peer->s = -1;
+			peer->id = chunk.id;
+			peer->service = chunk.service;
+			peer->recv.open = 1;
+			peer->recv.close = 0;
+			peer->recv.shut = 0;
+			peer->recv.slow = 0;
+			peer->recv.off = 0;
+			peer->recv.size = 0;
+			peer->recv.window = session.windowinit;
+			peer->recv.total = 0;
+			peer->recv.limit = (uint32_t)session.windowinit;
+			peer->send.open = 0;
+			peer->send.close = 0;
+			peer->send.shut = 0;
+			peer->send.size = 0;
+			peer->send.sent = 0;
+			peer->send.limit = (uint32_t)session.windowinit;
 		}
 
-		off = peers[i].recv.off + peers[i].recv.size;
-		size = sizeof(peers[i].recv.buf) - off;
-
-		if (msg->peer[i].size < size)
-			size = msg->peer[i].size;
+		n = msg_chunksize(peer, &chunk);
+		if (peer->id == chunk.id && n > 0 &&
+		    !msg_reserve(peer, (size_t)n))
+			return 0;
+	}
 
-		memcpy(peers[i].recv.buf + off, data, size);
-		peers[i].recv.size += size;
+	for (p = msg->data; (p = msg_getchunk(p, end, &chunk)) != NULL; ) {
+		if ((peer = msg_stream(peers, chunk.id)) == NULL ||
+		    peer->id != chunk.id)
+			continue;
 
-		if (msg->peer[i].closed)
-			peers[i].recv.close = 1;
+		if ((n = msg_chunksize(peer, &chunk)) == -1)
+			/* the caches went apart, the stream cannot go on */
+			peer->recv.close = 1;
+		else if (n > 0)
+			msg_append(peer, &chunk, (size_t)n);
 
-		peers[i].dontsend = msg->peer[i].blocked;
+		if (chunk.flags & ChunkClose)
+			peer->recv.close = 1;
 	}
 
+	/* learned in order, whatever became of the streams */
+	for (p = msg->data; (p = msg_getchunk(p, end, &chunk)) != NULL; )
+		if (chunk.flags & ChunkDedup)
+			dedup_learn(DedupIn, chunk.data, chunk.size);
+
+	/* only the sequence number is needed from now on */
+	msg_free(msg);
+	msg_setbit(ibits, iseq, 0);
 	iseq = (iseq + 1) & 0xffff;
 	return 1;
 }
@@ -221,72 +494,269 @@ msg_send(const int s, struct peer *const peers,
     const struct addrinfo *const to)
 {
 	struct msg	*const msg = OUT_HISTORY(oseq);
-	const size_t	 sendlimit = msg_sendlimit(peers);
-	size_t		 remaining = MessageDataMaxSize;
-	uint8_t		*data = msg->data;
-	int		 p;
+	size_t		 remaining, taken;
+	int		 i;
+
+	if (handshake) {
+		msg_sendhello(s, peers, to);
+		return;
+	}
+
+	msg_autotune(peers);
+	tune_udp(s);
+	taken = dgramtaken;
+	dgramtaken = 0;
+
+	for (i = 0; i < session.peers; ++i)
+		if (msg_pending(&peers[i]))
+			break;
+
+	if (i == session.peers) {
+		msg_sendidle(s, peers, to);
+		return;
+	}
+
+	/* the largest slab is a fallback, chunks must not be lost */
+	msg_free(msg);
+	if (slab_free[SlabClasses - 1] == NULL &&
+	    !msg_slabgrow(SlabClasses - 1))
+		return;
 
-	msg->delivered = 0;
+	keepalive = conf.keepalivemin;
 	msg->seq = oseq;
+	msg_setbit(obits, oseq, 1);
+	msg->sent = tune_now();
 	oseq = (oseq + 1) & 0xffff;
+	/* datagrams sent since the last message are of this budget */
+	remaining = session.datasize - msg_creditsize(peers);
+	/* datagrams may have spent more than the whole budget */
+	if (taken > budget)
+		taken = budget;
+	if (remaining > budget - taken)
+		remaining = budget - taken;
+
+	for (i = urgent = 0; i < session.peers; ++i)
+		urgent |= msg_urgent(&peers[i]);
+
+	msg->size = msg_fill(databuf, remaining, peers);
+	msg->data = msg_alloc(msg->size, &msg->slab);
+	memcpy(msg->data, databuf, msg->size);
+	msg_sendmsg(s, msg, Msg_OK, peers, to);
+	urgent = 0;
+}
 
-	for (p = 0; p < PeersMax; ++p) {
-		size_t		 size = peers[p].send.size;
-		uint8_t		*src = peers[p].send.buf;
-
-		if (peers[p].dontsend) size = 0;
-		if (sendlimit < size) size = sendlimit;
-		if (remaining < size) size = remaining;
-
-		msg->peer[p].opened = peers[p].send.open;
-		msg->peer[p].closed = 0;
-		msg->peer[p].blocked = peers[p].recv.size >= AlertSize;
-		msg->peer[p].size = size;
-		memcpy(data, src, size);
-		memmove(src, src + size, peers[p].send.size -= size);
-		remaining -= size;
-
-		peers[p].send.open = 0;
-		if (peers[p].send.size == 0) {
-			msg->peer[p].closed = peers[p].send.close;
-			peers[p].send.close = 0;
-		}
+void
+msg_sendhello(const int s, struct peer *const peers,
+    const struct addrinfo *const to)
+{
+	struct msg	*const msg = OUT_HISTORY(0);
+	int		 i;
+
+	for (i = 0; oseq == 0 && i < session.peers; ++i)
+		if (msg_pending(&peers[i]))
+			break;
+
+	/* the first message rides on the reset if it is ready in time */
+	if (oseq == 0 && i < session.peers && conf.earlysize > ChunkHeaderMax) {
+		msg_free(msg);
+		if (slab_free[SlabClasses - 1] == NULL &&
+		    !msg_slabgrow(SlabClasses - 1))
+			return;
+
+		msg->seq = 0;
+		msg_setbit(obits, 0, 1);
+		msg->sent = 0;
+		oseq = 1;
+		msg->size = msg_fill(databuf, conf.earlysize, peers);
+		msg->data = msg_alloc(msg->size, &msg->slab);
+		memcpy(msg->data, databuf, msg->size);
+	}
+
+	msg_sendmsg(s, oseq != 0 ? msg : NULL, Msg_Reset, peers, to);
+}
+
+size_t
+msg_fill(uint8_t *const buf, size_t remaining, struct peer *const peers)
+{
+	uint8_t		*data = buf;
+	size_t		 sendlimit = msg_sendlimit(peers, remaining);
+	const int	 dedup = session.dedup > 0 && !handshake;
+	const uint8_t	*p;
+	struct chunk	 c;
+	int		 i;
+
+	for (i = 0; i < session.peers; ++i) {
+		struct peer	*const peer = &peers[(sstart + i) % session.peers];
+		uint8_t		*const chunk = data;
+		size_t		 size = msg_sendable(peer), wire;
+		int		 flags = 0, more;
+
+		/* with dedup the limit is on what goes on the wire */
+		if (!dedup && sendlimit < size)
+			size = sendlimit;
+
+		if (size == 0 && !peer->send.open &&
+		    !(peer->send.close && peer->send.size == 0))
+			continue;
+		else if (remaining < ChunkHeaderMax)
+			break;
+
+		wire = remaining - ChunkHeaderMax;
+		if (dedup && size > 0) {
+			more = !peer->send.close && (size < peer->send.size ||
+			    peer->send.size == session.peermaxsend);
+			wire = dedup_encode(peer->send.buf, &size, more,
+			    dedupbuf, sendlimit < wire ? sendlimit : wire);
+			flags |= ChunkDedup;
+		} else if (wire < size)
+			size = wire;
+		else
+			wire = size;
+
+		if (peer->send.open)
+			flags |= ChunkOpen;
+		if (peer->send.open && peer->service != 0)
+			flags |= ChunkService;
+		if (peer->send.close && peer->send.size == size)
+			flags |= ChunkClose;
+
+		data += msg_putvarint(data, peer->id);
+		data += msg_putvarint(data, peer->send.sent);
+		*data++ = (uint8_t)flags;
+		if (flags & ChunkService)
+			*data++ = (uint8_t)peer->service;
+		data += msg_putvarint(data, (uint32_t)wire);
+		memcpy(data, flags & ChunkDedup ? dedupbuf : peer->send.buf,
+		    wire);
+		memmove(peer->send.buf, peer->send.buf + size,
+		    peer->send.size -= size);
+		peer->send.sent += (uint32_t)size;
+		data += wire;
+		remaining -= (size_t)(data - chunk);
+
+		peer->send.open = 0;
+		if (flags & ChunkClose)
+			peer->send.close = 0;
 	}
 
-	msg_sendmsg(s, msg, 0, to);
+	/* the other side learns the same chunks processing this message */
+	for (p = buf; dedup && (p = msg_getchunk(p, data, &c)) != NULL; )
+		if (c.flags & ChunkDedup)
+			dedup_learn(DedupOut, c.data, c.size);
+
+	sstart = (sstart + 1) % session.peers;
+	return (size_t)(data - buf);
+}
+
+void
+msg_sendack(const int s, const struct peer *const peers,
+    const struct addrinfo *const to)
+{
+	if (!handshake && unacked >= conf.ackfrequency)
+		msg_sendmsg(s, NULL, Msg_Ack, peers, to);
 }
 
 void
 msg_sendreset(const int s, const enum Msg reset_type,
     const struct addrinfo *const to)
 {
-	msg_sendmsg(s, NULL, reset_type, to);
+	msg_sendmsg(s, NULL, reset_type, NULL, to);
 }
 
 int
-msg_resendold(const int s, const struct addrinfo *const to)
+msg_sendresync(const int s, const enum Msg resync_type,
+    const struct peer *const peers, const struct addrinfo *const to)
 {
-	int		 i;
-	const struct msg *const oldest = OUT_HISTORY(oseq);
-	struct msg	*best = NULL;
+	/* unanswered for resetafter seconds, the session is reset instead */
+	if (resync_type == Msg_Resync) {
+		if (resyncs == 0)
+			clock_gettime(CLOCK_MONOTONIC, &resynctime);
+		else if (msg_elapsed(&resynctime) >=
+		    conf.resetafter * (long long)Second)
+			return 0;
+		++resyncs;
+	}
+
+	msg_sendmsg(s, NULL, resync_type, peers, to);
+	return 1;
+}
+
+void
+msg_sendprobe(const int s, const struct addrinfo *const to)
+{
+	msg_sendmsg(s, NULL, Msg_Probe_OK, NULL, to);
+}
 
-	for (i = 0; i < MessageHistory; ++i) {
-		struct msg	*const msg = &ohist[i];
+void
+msg_senddgram(const int s, const uint32_t flow, const uint8_t *const data,
+    const size_t size, const struct addrinfo *const to)
+{
+	struct msg	 msg;
 
-		if (msg->seq >= 0 && !msg->delivered && (best == NULL
-		    || DIFF16(best->lasttry, msg->lasttry) < 0x8000))
-			best = msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.size = msg_varintsize(flow) + size;
+
+	/* the budget is of a tick, idle streams send no message to renew it */
+	if (msg_elapsed(&dgramtime) >= Second / conf.frequency) {
+		clock_gettime(CLOCK_MONOTONIC, &dgramtime);
+		dgramtaken = 0;
 	}
 
+	/* what does not fit, in size or in budget, is lost as on the way */
+	if (handshake || msg.size > session.datasize ||
+	    dgramtaken + msg.size > budget)
+		return;
+
+	dgramtaken += msg.size;
+	tune_count(TuneOut, msg.size);
+	msg.data = databuf;
+	memcpy(databuf + msg_putvarint(databuf, flow), data, size);
+	msg_sendmsg(s, &msg, Msg_Datagram, NULL, to);
+}
+
+void
+msg_migrate(struct addrinfo *const to)
+{
+	/* the address is rewritten in place, it must have room for any */
+	path = to;
+	candidate = *to;
+	candidate.ai_addr = (struct sockaddr *)&candidate_addr;
+	candidate.ai_next = NULL;
+	candidate_addr.ss_family = AF_UNSPEC;
+}
+
+int
+msg_resendold(const int s, const struct peer *const peers,
+    const struct addrinfo *const to)
+{
+	struct msg	*best = NULL;
+	uint64_t	 x;
+	size_t		 w;
+
+	/* the first message is resent with the reset until it is agreed */
+	if (handshake)
+		return 0;
+
+	/* only the messages not acked are looked at */
+	for (w = 0; w < RING_WORDS(session.history); ++w)
+		for (x = obits[w]; x != 0; x &= x - 1) {
+			struct msg	*const msg =
+			    &ohist[w << 6 | (size_t)__builtin_ctzll(x)];
+
+			if (best == NULL ||
+			    DIFF16(best->lasttry, msg->lasttry) < 0x8000)
+				best = msg;
+		}
+
 	if (best == NULL)
 		return 0;
-	else if (DIFF16(useq, best->lasttry) >= MessageHistory / 2)
-		msg_sendmsg(s, best, 0, to);
-	else if (oldest->seq == oseq && !oldest->delivered)
-		msg_sendmsg(s, best, 0, to);
-	else
+	else if (DIFF16(useq, best->lasttry) < session.history / 2 &&
+	    !msg_bit(obits, oseq))
 		return 0;
 
+	/* the ack may be of either try, it is not timed */
+	best->sent = 0;
+	msg_sendmsg(s, best, Msg_OK, peers, to);
 	return 1;
 }
 
@@ -296,209 +766,1610 @@ msg_reset(struct peer *const peers)
 	int		 i;
 
 	iseq = oseq = useq = 0;
-	for (i = 0; i < MessageHistory; ++i) {
+	cstart = sstart = 0;
+	unacked = ackdue = 0;
+	keepalive = conf.keepalivemin;
+	cemarks = rcemarks = 0;
+	recover = -1;
+
+	/* a new epoch names this reset, ours until the peer agrees */
+	epoch = pepoch = 0;
+	handshake = 1;
+	resyncs = 0;
+	session = conf;
+	budget = session.datasize;
+
+	for (i = 0; i < conf.history; ++i) {
+		msg_free(&ihist[i]);
+		msg_free(&ohist[i]);
 		ihist[i].seq = -1;
 		ohist[i].seq = -1;
 	}
 
-	for (i = 0; i < PeersMax; ++i) {
+	memset(ibits, 0, RING_WORDS(conf.history) * sizeof(*ibits));
+	memset(obits, 0, RING_WORDS(conf.history) * sizeof(*obits));
+
+	for (i = 0; i < conf.peers; ++i) {
 		if (peers[i].s != -1)
 			close(peers[i].s);
 
+		free(peers[i].recv.buf);
+		spill_drop(&peers[i]);
 		peers[i].free = 1;
-		peers[i].dontsend = 1;
 		peers[i].s = -1;
+		peers[i].id = (uint32_t)i;
 		peers[i].recv.open = 0;
 		peers[i].recv.close = 0;
+		peers[i].recv.shut = 0;
+		peers[i].recv.slow = 0;
 		peers[i].recv.off = 0;
 		peers[i].recv.size = 0;
+		peers[i].recv.cap = 0;
+		peers[i].recv.window = 0;
+		peers[i].recv.total = 0;
+		peers[i].recv.limit = 0;
+		peers[i].recv.buf = NULL;
 		peers[i].send.open = 0;
 		peers[i].send.close = 0;
+		peers[i].send.shut = 0;
 		peers[i].send.size = 0;
+		peers[i].send.sent = 0;
+		peers[i].send.limit = 0;
 	}
 }
 
-struct timeval *
-msg_gettimeout(struct timeval *const timeout)
+void
+msg_agree(struct peer *const peers)
 {
-	enum {
-		Second = 1000 * 1000 * 1000,
-		Exact = Second / SendFrequency,
-		Enough = Exact * 3 / 4
-	};
-	struct timespec	 curtime, td;
+	int		 i;
 
-	clock_gettime(CLOCK_MONOTONIC, &curtime);
-	td.tv_sec = curtime.tv_sec - last_sendtime.tv_sec;
-	td.tv_nsec = curtime.tv_nsec - last_sendtime.tv_nsec;
-
-	if (td.tv_sec != 0 && td.tv_nsec < 0) {
-		--td.tv_sec;
-		td.tv_nsec += Second;
-	} else if (td.tv_nsec < 0)
-		td.tv_nsec = 0;
-
-	if (td.tv_sec == 0 && td.tv_nsec < Enough) {
-		timeout->tv_sec = 0;
-		timeout->tv_usec = (Exact - td.tv_nsec) / 1000;
-		return timeout;
-	} else
-		return NULL;
+	/* sizes are the smaller of ours and what the peer sent in reset */
+	session = conf;
+	if (pconf.datagram < session.datagram)
+		session.datagram = pconf.datagram;
+	if (pconf.history < session.history)
+		session.history = pconf.history;
+	if (pconf.windowinit < session.windowinit)
+		session.windowinit = pconf.windowinit;
+	if (pconf.windowmax < session.windowmax)
+		session.windowmax = pconf.windowmax;
+	if (pconf.dedup < session.dedup)
+		session.dedup = pconf.dedup;
+	conf_derive(&session);
+	msg_fit();
+	if (pconf.peers < session.peers)
+		session.peers = pconf.peers;
+	dedup_reset(session.dedup);
+	budget = session.datasize;
+	handshake = 0;
+
+	/* streams opened meanwhile assumed our window, no credit is sent yet */
+	for (i = 0; i < conf.peers; ++i) {
+		struct peer	*const peer = &peers[i];
+		const uint32_t	 w = (uint32_t)session.windowinit;
+
+		if (peer->free)
+			continue;
+		else if (i >= session.peers) {
+			/* the other side has no such slot, the stream must go */
+			if (peer->s != -1)
+				close(peer->s);
+			peer->s = -1;
+			peer->free = 1;
+			peer->send.open = peer->send.close = 0;
+			peer->send.size = 0;
+			peer->recv.close = 0;
+			continue;
+		}
+		if (peer->recv.window > session.windowinit)
+			peer->recv.window = session.windowinit;
+		if (peer->recv.limit > w)
+			peer->recv.limit = w;
+		if (peer->send.limit > w)
+			peer->send.limit = peer->send.sent > w ? peer->send.sent : w;
+	}
 }
 
-size_t
-msg_sendlimit(const struct peer *const peers)
+void
+msg_fit(void)
 {
-	size_t		 low = 0, high = PeerMaxSend;
-
-	while (low < high) {
-		const size_t	 mid = (low + high) >> 1;
-		size_t		 size = 0;
-		int		 i;
+	/* a shorter history leaves more room than the buffers of either side */
+	if (session.datasize > conf.datasize)
+		session.datasize = conf.datasize;
+	if (session.datasize > pconf.datasize)
+		session.datasize = pconf.datasize;
+	if (session.peermaxsend > conf.peermaxsend)
+		session.peermaxsend = conf.peermaxsend;
+	if (session.peermaxsend > pconf.peermaxsend)
+		session.peermaxsend = pconf.peermaxsend;
+	session.windowmin = 2 * session.peermaxsend;
+}
 
-		for (i = 0; i < PeersMax; ++i) {
-			const size_t	 t = peers[i].send.size;
-			if (!peers[i].dontsend)
-				size += t < mid ? t : mid;
-		}
+int
+msg_strike(const uint32_t repoch)
+{
+	int		 i;
 
-		if (size == MessageDataMaxSize)
-			return mid;
-		else if (size < MessageDataMaxSize)
-			low = mid + 1;
-		else
-			high = mid;
-	}
+	/* a reset is accepted once, replays of it are refused */
+	for (i = 0; i < StrikeMax; ++i)
+		if (strikes[i] == repoch)
+			return 0;
 
-	return low;
+	strikes[strike++ % StrikeMax] = repoch;
+	return 1;
 }
 
 void
-msg_sendmsg(const int s, struct msg *const msg,
-    const enum Msg reset_type, const struct addrinfo *const to)
+msg_early(const uint8_t *const data, const uint8_t *const end)
 {
-	enum {
-		Second = 1000 * 1000 * 1000,
-		Exact = Second / SendFrequency,
-		Near = Exact / 2,
-		Far = Exact * 3 / 2
-	};
-	const uint32_t	 msgtime = (uint32_t)time(NULL);
-	unsigned char	 buf[DatagramMaxSize + MD5_DIGEST_LENGTH];
-	size_t		 i, size, datasize;
-	MD5_CTX		 md5_ctx;
-	uint8_t		 digest[MD5_DIGEST_LENGTH];
-	struct timespec	 curtime, td;
-	seq_t		 rnext;
-	int		 p;
+	struct msg	*const msg = IN_HISTORY(0);
+	const size_t	 size = (size_t)(end - data);
 
-	clock_gettime(CLOCK_MONOTONIC, &curtime);
-	td.tv_sec = curtime.tv_sec - last_sendtime.tv_sec;
-	td.tv_nsec = curtime.tv_nsec - last_sendtime.tv_nsec;
-
-	if (td.tv_sec != 0 && td.tv_nsec < 0) {
-		--td.tv_sec;
-		td.tv_nsec += Second;
-	} else if (td.tv_nsec < 0)
-		td.tv_nsec = 0;
+	/* a reset from before our start may be replayed, strikes are lost */
+	if (size == 0 || iseq != 0 || msg->seq == 0 ||
+	    msg_elapsed(&started) < TimeDiffMax * (long long)Second)
+		return;
 
-	if (td.tv_sec == 0 && td.tv_nsec < Near)
+	msg_free(msg);
+	if ((msg->data = msg_alloc(size, &msg->slab)) == NULL)
 		return;
-	else if (td.tv_sec > 0 || td.tv_nsec > Far)
-		memcpy(&last_sendtime, &curtime, sizeof(curtime));
-	else if ((last_sendtime.tv_nsec += Exact) >= Second) {
-		++last_sendtime.tv_sec;
-		last_sendtime.tv_nsec -= Second;
-	}
 
-	arc4random_buf(buf, 8);
-	size = 16;
-	buf[size++] = (uint8_t)(msgtime >> 24);
-	buf[size++] = (uint8_t)(msgtime >> 16);
-	buf[size++] = (uint8_t)(msgtime >> 8);
-	buf[size++] = (uint8_t)msgtime;
+	msg->seq = 0;
+	msg->size = size;
+	msg_setbit(ibits, 0, 1);
+	memcpy(msg->data, data, size);
+}
 
-	if (msg == NULL)
-		buf[size++] = (uint8_t)reset_type;
-	else if (msg->seq < 0)
+void
+msg_probe(const int s)
+{
+	/* only datagrams of this session from elsewhere start a probe */
+	if (!current || path == NULL || source.ss_family == AF_UNSPEC ||
+	    msg_samepath(&source, path->ai_addr))
 		return;
-	else {
-		msg->lasttry = useq;
-		useq = (useq + 1) & 0xffff;
-		buf[size++] = (uint8_t)(msg->seq >> 8);
-		buf[size++] = (uint8_t)msg->seq;
 
-		for (rnext = iseq; ; rnext = (rnext + 1) & 0xffff) {
-			const struct msg *const m = IN_HISTORY(rnext);
+	/* the token stays while the same address is probed */
+	if (!msg_samepath(&source, candidate.ai_addr)) {
+		candidate_addr = source;
+		candidate.ai_family = source.ss_family;
+		candidate.ai_addrlen = source.ss_family == AF_INET6 ?
+		    sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+		arc4random_buf(challenge, sizeof(challenge));
+	} else if (msg_elapsed(&probed) < Second)
+		/* a lost probe is resent, unanswered ones not too often */
+		return;
 
-			if (m->seq != rnext || !m->delivered)
-				break;
-		}
+	clock_gettime(CLOCK_MONOTONIC, &probed);
+	msg_sendmsg(s, NULL, Msg_Probe, NULL, &candidate);
+}
 
-		buf[size++] = (uint8_t)(rnext >> 8);
-		buf[size++] = (uint8_t)rnext;
-		memset(buf + size, 0, ReportSize - 2);
+int
+msg_samepath(const struct sockaddr_storage *const a,
+    const struct sockaddr *const b)
+{
+	if (a->ss_family != b->sa_family)
+		return 0;
+	else if (a->ss_family == AF_INET) {
+		const struct sockaddr_in *const x = (const void *)a;
+		const struct sockaddr_in *const y = (const void *)b;
+
+		return x->sin_port == y->sin_port &&
+		    x->sin_addr.s_addr == y->sin_addr.s_addr;
+	} else if (a->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *const x = (const void *)a;
+		const struct sockaddr_in6 *const y = (const void *)b;
+
+		return x->sin6_port == y->sin6_port &&
+		    memcmp(&x->sin6_addr, &y->sin6_addr,
+		    sizeof(x->sin6_addr)) == 0;
+	}
 
-		for (p = 0; p < ReportCount; ++p) {
-			const uint8_t	 bit = 1 << (7 - (p & 7));
-			const seq_t	 seq = rnext + p + 1;
-			const struct msg *const m = IN_HISTORY(seq);
+	return 0;
+}
 
-			if (m->seq == seq && m->delivered)
-				buf[size + (p >> 3)] |= bit;
-		}
+void
+msg_moveto(const struct sockaddr_storage *const addr)
+{
+	if (addr->ss_family != AF_INET && addr->ss_family != AF_INET6)
+		return;
 
-		size += ReportSize - 2;
-		datasize = 0;
+	memcpy(path->ai_addr, addr, sizeof(*addr));
+	path->ai_family = addr->ss_family;
+	path->ai_addrlen = addr->ss_family == AF_INET6 ?
+	    sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+	candidate_addr.ss_family = AF_UNSPEC;
+}
 
-		for (p = 0; p < PeersMax; ++p) {
-			size_t		 x;
+int
+msg_save(FILE *const fp, const struct peer *const peers)
+{
+	int		 i;
 
-			datasize += x = msg->peer[p].size;
-			x *= 3;
-			x += msg->peer[p].closed ? 2 :
-			    msg->peer[p].blocked ? 1 : 0;
-			buf[size++] = (uint8_t)(x >> 8);
-			buf[size++] = (uint8_t)x;
+	msg_put(fp, SnapshotVersion);
+	msg_put(fp, (uint32_t)conf.peers);
+	msg_put(fp, (uint32_t)session.datagram);
+	msg_put(fp, (uint32_t)session.history);
+	msg_put(fp, (uint32_t)session.windowinit);
+	msg_put(fp, (uint32_t)session.windowmax);
+	msg_put(fp, (uint32_t)session.dedup);
+	msg_put(fp, (uint32_t)session.peers);
+	msg_put(fp, (uint32_t)pconf.datagram);
+	msg_put(fp, (uint32_t)pconf.history);
+	msg_put(fp, (uint32_t)pconf.windowinit);
+	msg_put(fp, (uint32_t)pconf.windowmax);
+	msg_put(fp, (uint32_t)pconf.dedup);
+	msg_put(fp, (uint32_t)pconf.spill);
+	msg_put(fp, (uint32_t)pconf.peers);
+	msg_put(fp, (uint32_t)iseq);
+	msg_put(fp, (uint32_t)oseq);
+	msg_put(fp, (uint32_t)useq);
+	msg_put(fp, epoch);
+	msg_put(fp, pepoch);
+	msg_put(fp, (uint32_t)cstart);
+	msg_put(fp, (uint32_t)sstart);
+	msg_put(fp, (uint32_t)unacked);
+	msg_put(fp, (uint32_t)ackdue);
+	msg_put(fp, (uint32_t)keepalive);
+	msg_put(fp, cemarks);
+	msg_put(fp, rcemarks);
+	msg_put(fp, (uint32_t)budget);
+	msg_put(fp, (uint32_t)recover);
+	msg_put(fp, (uint32_t)handshake);
+	msg_put(fp, strike);
+	for (i = 0; i < StrikeMax; ++i)
+		msg_put(fp, strikes[i]);
+
+	/* the monotonic clock is the same for the next process */
+	msg_put(fp, (uint32_t)last_sendtime.tv_sec);
+	msg_put(fp, (uint32_t)last_sendtime.tv_nsec);
+	msg_put(fp, (uint32_t)last_frametime.tv_sec);
+	msg_put(fp, (uint32_t)last_frametime.tv_nsec);
+	msg_put(fp, (uint32_t)started.tv_sec);
+	msg_put(fp, (uint32_t)started.tv_nsec);
+
+	/* where the peer has moved to, if we follow it */
+	msg_put(fp, path != NULL ? (uint32_t)path->ai_addrlen : 0);
+	if (path != NULL)
+		fwrite(path->ai_addr, 1, path->ai_addrlen, fp);
+
+	for (i = 0; i < session.history; ++i) {
+		msg_putmsg(fp, &ihist[i]);
+		msg_putmsg(fp, &ohist[i]);
+	}
+	fwrite(ibits, sizeof(*ibits), RING_WORDS(session.history), fp);
+	fwrite(obits, sizeof(*obits), RING_WORDS(session.history), fp);
+
+	for (i = 0; i < conf.peers; ++i) {
+		const struct peer *const peer = &peers[i];
+
+		msg_put(fp, (uint32_t)peer->free);
+		msg_put(fp, peer->id);
+		msg_put(fp, (uint32_t)peer->service);
+		msg_put(fp, (uint32_t)peer->recv.open);
+		msg_put(fp, (uint32_t)peer->recv.close);
+		msg_put(fp, (uint32_t)peer->recv.shut);
+		msg_put(fp, (uint32_t)peer->recv.slow);
+		msg_put(fp, (uint32_t)peer->recv.window);
+		msg_put(fp, peer->recv.total);
+		msg_put(fp, peer->recv.limit);
+		msg_put(fp, (uint32_t)peer->recv.size);
+		fwrite(peer->recv.buf + peer->recv.off, 1, peer->recv.size, fp);
+		msg_put(fp, (uint32_t)peer->recv.spilled);
+		spill_save(fp, peer);
+		msg_put(fp, (uint32_t)peer->send.open);
+		msg_put(fp, (uint32_t)peer->send.close);
+		msg_put(fp, (uint32_t)peer->send.shut);
+		msg_put(fp, peer->send.sent);
+		msg_put(fp, peer->send.limit);
+		msg_put(fp, (uint32_t)peer->send.size);
+		fwrite(peer->send.buf, 1, peer->send.size, fp);
+	}
 
-			if (msg->peer[p].opened)
-				buf[size - 2] |= 128;
-		}
+	if (session.dedup > 0 && dedup_save(fp) == -1)
+		return -1;
 
-		memcpy(buf + size, msg->data, datasize);
-		size += datasize;
+	return fflush(fp) == 0 && !ferror(fp) ? 0 : -1;
+}
 
-		if (size < DatagramMaxSize) {
-			size_t		 r = DatagramMaxSize - size;
+int
+msg_load(FILE *const fp, struct peer *const peers)
+{
+	struct conf	 s = conf, p = conf;
+	struct sockaddr_storage addr;
+	size_t		 addrlen;
+	int		 i, speers, ppeers;
+
+	if (msg_get(fp) != SnapshotVersion ||
+	    msg_get(fp) != (uint32_t)conf.peers)
+		return -1;
+
+	s.datagram = msg_get(fp);
+	s.history = (int)msg_get(fp);
+	s.windowinit = msg_get(fp);
+	s.windowmax = msg_get(fp);
+	s.dedup = msg_get(fp);
+	speers = (int)msg_get(fp);
+	p.datagram = msg_get(fp);
+	p.history = (int)msg_get(fp);
+	p.windowinit = msg_get(fp);
+	p.windowmax = msg_get(fp);
+	p.dedup = msg_get(fp);
+	p.spill = msg_get(fp);
+	ppeers = (int)msg_get(fp);
+
+	/* our buffers are sized by our settings, the session must fit */
+	if (conf_derive(&s) != NULL || conf_derive(&p) != NULL ||
+	    s.datagram > conf.datagram || s.history > conf.history ||
+	    s.dedup > conf.dedup || speers < 1 || speers > conf.peers ||
+	    ppeers < 1 || ppeers > StreamSlots)
+		return -1;
+
+	s.peers = speers;
+	p.peers = ppeers;
+	session = s;
+	pconf = p;
+	msg_fit();
+	iseq = (seq_t)msg_get(fp);
+	oseq = (seq_t)msg_get(fp);
+	useq = (seq_t)msg_get(fp);
+	epoch = msg_get(fp);
+	pepoch = msg_get(fp);
+	cstart = (int)msg_get(fp) % session.peers;
+	sstart = (int)msg_get(fp) % session.peers;
+	unacked = (int)msg_get(fp);
+	ackdue = (int)msg_get(fp);
+	keepalive = (int)msg_get(fp);
+	cemarks = (uint8_t)msg_get(fp);
+	rcemarks = (uint8_t)msg_get(fp);
+	budget = msg_get(fp);
+	recover = (seq_t)(int32_t)msg_get(fp);
+	handshake = (int)msg_get(fp);
+	strike = msg_get(fp);
+	for (i = 0; i < StrikeMax; ++i)
+		strikes[i] = msg_get(fp);
+	last_sendtime.tv_sec = (time_t)msg_get(fp);
+	last_sendtime.tv_nsec = (long)msg_get(fp);
+	last_frametime.tv_sec = (time_t)msg_get(fp);
+	last_frametime.tv_nsec = (long)msg_get(fp);
+	started.tv_sec = (time_t)msg_get(fp);
+	started.tv_nsec = (long)msg_get(fp);
+
+	memset(&addr, 0, sizeof(addr));
+	if ((addrlen = msg_get(fp)) > sizeof(addr) ||
+	    fread(&addr, 1, addrlen, fp) != addrlen)
+		return -1;
+	else if (addrlen > 0 && path != NULL)
+		msg_moveto(&addr);
+
+	for (i = 0; i < session.history; ++i)
+		if (!msg_getmsg(fp, &ihist[i]) || !msg_getmsg(fp, &ohist[i]))
+			return -1;
+	if (fread(ibits, sizeof(*ibits), RING_WORDS(session.history), fp) !=
+	    RING_WORDS(session.history) || fread(obits, sizeof(*obits),
+	    RING_WORDS(session.history), fp) != RING_WORDS(session.history))
+		return -1;
+
+	for (i = 0; i < conf.peers; ++i) {
+		struct peer	*const peer = &peers[i];
+		size_t		 size;
 
-			r = r < 15 ? r : 15;
-			r = (ssize_t)arc4random_uniform((uint32_t)r);
-			memset(buf + size, 0, r);
-			size += r;
-		}
+		peer->free = (char)msg_get(fp);
+		peer->id = msg_get(fp);
+		peer->service = (int)(msg_get(fp) % ServiceMax);
+		peer->recv.open = (char)msg_get(fp);
+		peer->recv.close = (char)msg_get(fp);
+		peer->recv.shut = (char)msg_get(fp);
+		peer->recv.slow = (int)msg_get(fp);
+		peer->recv.window = msg_get(fp);
+		peer->recv.total = msg_get(fp);
+		peer->recv.limit = msg_get(fp);
+		size = msg_get(fp);
+		if (!msg_reserve(peer, size) ||
+		    fread(peer->recv.buf, 1, size, fp) != size)
+			return -1;
+		peer->recv.size = size;
+		if (!spill_load(fp, peer, msg_get(fp)))
+			return -1;
+		peer->send.open = (char)msg_get(fp);
+		peer->send.close = (char)msg_get(fp);
+		peer->send.shut = (char)msg_get(fp);
+		peer->send.sent = msg_get(fp);
+		peer->send.limit = msg_get(fp);
+		if ((size = msg_get(fp)) > conf.peermaxsend ||
+		    fread(peer->send.buf, 1, size, fp) != size)
+			return -1;
+		peer->send.size = size;
 	}
 
-	MD5Init(&md5_ctx);
-	MD5Update(&md5_ctx, buf + 2, 6);
-	MD5Update(&md5_ctx, psk, sizeof(psk));
-	MD5Update(&md5_ctx, buf + 16, size - 16);
-	MD5Final(digest, &md5_ctx);
+	dedup_reset(session.dedup);
+	if (session.dedup > 0 && dedup_load(fp) == -1)
+		return -1;
 
-	for (i = 0; i < 8; ++i)
-		buf[i + 8] = digest[i];
+	return ferror(fp) || feof(fp) ? -1 : 0;
+}
 
-	MD5Init(&md5_ctx);
-	MD5Update(&md5_ctx, buf + 2, 6);
+void
+msg_put(FILE *const fp, const uint32_t x)
+{
+	fwrite(&x, sizeof(x), 1, fp);
+}
 
-	for (i = 16; i < size; i += MD5_DIGEST_LENGTH) {
-		int		 j;
+uint32_t
+msg_get(FILE *const fp)
+{
+	uint32_t	 x;
 
-		MD5Update(&md5_ctx, psk, sizeof(psk));
-		MD5Final(digest, &md5_ctx);
+	/* errors are found by feof and ferror at the end */
+	return fread(&x, sizeof(x), 1, fp) == 1 ? x : 0;
+}
 
-		for (j = 0; j < MD5_DIGEST_LENGTH; ++j)
-			buf[i + j] ^= digest[j];
+void
+msg_putmsg(FILE *const fp, const struct msg *const msg)
+{
+	msg_put(fp, (uint32_t)msg->seq);
+	msg_put(fp, (uint32_t)msg->lasttry);
+	msg_put(fp, msg->data != NULL ? (uint32_t)msg->size : 0);
+	if (msg->data != NULL)
+		fwrite(msg->data, 1, msg->size, fp);
+}
+
+int
+msg_getmsg(FILE *const fp, struct msg *const msg)
+{
+	size_t		 size;
+
+	msg->seq = (seq_t)(int32_t)msg_get(fp);
+	msg->lasttry = (seq_t)msg_get(fp);
+	msg->sent = 0;
+	msg->size = size = msg_get(fp);
+	if (size == 0)
+		return 1;
+	else if (size > session.datasize ||
+	    (msg->data = msg_alloc(size, &msg->slab)) == NULL)
+		return 0;
+
+	return fread(msg->data, 1, size, fp) == size;
+}
+
+void
+msg_consume(struct peer *const peer, const size_t size)
+{
+	peer->recv.off += size;
+	peer->recv.size -= size;
+	spill_pull(peer);
+	if (peer->recv.size > 0)
+		return;
+
+	peer->recv.off = 0;
+	if (peer->recv.cap > session.windowmin) {
+		free(peer->recv.buf);
+		peer->recv.buf = NULL;
+		peer->recv.cap = 0;
+	}
+}
+
+struct timeval *
+msg_gettimeout(struct timeval *const timeout, const struct peer *const peers)
+{
+	long long	 exact = Second / conf.frequency, enough, td;
+	int		 i, lead = 0;
+
+	/* resyncs are sent ever less often, at least once a second */
+	for (i = 0; peers == NULL && i < resyncs && exact < Second; ++i)
+		exact <<= 1;
+	if (exact > Second)
+		exact = Second;
+	enough = exact * 3 / 4;
+
+	if (peers != NULL && msg_idle(peers)) {
+		/* sleep until the next keepalive */
+		const long long	 left = keepalive * (long long)Second -
+		    msg_elapsed(&last_frametime);
+
+		if (left <= 0)
+			return NULL;
+
+		timeout->tv_sec = (time_t)(left / Second);
+		timeout->tv_usec = (suseconds_t)(left % Second / 1000);
+		return timeout;
 	}
 
+	/* the kernel paces queued data, opens and ends borrow later ticks */
+	for (i = 0; peers != NULL && i < session.peers; ++i)
+		if ((txtime && msg_pending(&peers[i])) || msg_urgent(&peers[i]))
+			lead = PacingLead;
+
+	if ((td = msg_elapsed(&last_sendtime) + lead * exact) < enough) {
+		timeout->tv_sec = (time_t)((exact - td) / Second);
+		timeout->tv_usec = (suseconds_t)((exact - td) % Second / 1000);
+		return timeout;
+	} else
+		return NULL;
+}
+
+int
+msg_txtime(const int s)
+{
+#ifdef USE_TXTIME
+	const struct sock_txtime txt = { CLOCK_MONOTONIC, 0 };
+
+	txtime = setsockopt(s, SOL_SOCKET, SO_TXTIME, &txt, sizeof(txt)) == 0;
+#else
+	(void)s;
+#endif
+	return txtime;
+}
+
+void
+msg_sendto(const int s, const uint8_t *const buf, const size_t size,
+    const struct addrinfo *const to, const struct timespec *const when)
+{
+#ifdef USE_TXTIME
+	union {
+		struct cmsghdr	 hdr;
+		uint8_t		 buf[CMSG_SPACE(sizeof(uint64_t))];
+	}		 cmsg;
+	struct msghdr	 mh;
+	struct iovec	 iov;
+	uint64_t	 t;
+
+	if (txtime && when != NULL) {
+		t = (uint64_t)when->tv_sec * Second + (uint64_t)when->tv_nsec;
+		iov.iov_base = (void *)buf;
+		iov.iov_len = size;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_name = to->ai_addr;
+		mh.msg_namelen = to->ai_addrlen;
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = cmsg.buf;
+		mh.msg_controllen = sizeof(cmsg.buf);
+		cmsg.hdr.cmsg_level = SOL_SOCKET;
+		cmsg.hdr.cmsg_type = SCM_TXTIME;
+		cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(t));
+		memcpy(CMSG_DATA(&cmsg.hdr), &t, sizeof(t));
+		sendmsg(s, &mh, 0);
+		return;
+	}
+#else
+	(void)when;
+#endif
 	sendto(s, buf, size, 0, to->ai_addr, to->ai_addrlen);
 }
+
+int
+msg_ecn(const int s, const struct addrinfo *const ai)
+{
+#ifdef USE_ECN
+	const int	 ect = IPTOS_ECN_ECT0, on = 1;
+
+	if (ai->ai_family == AF_INET6)
+		return setsockopt(s, IPPROTO_IPV6, IPV6_TCLASS, &ect,
+		    sizeof(ect)) == 0 && setsockopt(s, IPPROTO_IPV6,
+		    IPV6_RECVTCLASS, &on, sizeof(on)) == 0;
+	else
+		return setsockopt(s, IPPROTO_IP, IP_TOS, &ect,
+		    sizeof(ect)) == 0 && setsockopt(s, IPPROTO_IP,
+		    IP_RECVTOS, &on, sizeof(on)) == 0;
+#else
+	(void)s;
+	(void)ai;
+	return 0;
+#endif
+}
+
+ssize_t
+msg_recvce(const int s, uint8_t *const buf, const size_t size,
+    const int flags, int *const ce, struct sockaddr_storage *const from)
+{
+#if defined(USE_IO_URING)
+	/* the ring does not keep the source, the peer is not followed */
+	*ce = 0;
+	from->ss_family = AF_UNSPEC;
+	return recv(s, buf, size, flags);
+#elif defined(USE_ECN) || defined(SO_RXQ_OVFL)
+	union {
+		struct cmsghdr	 hdr;
+		uint8_t		 buf[CMSG_SPACE(sizeof(int)) +
+				    CMSG_SPACE(sizeof(uint32_t))];
+	}		 cmsg;
+	struct msghdr	 mh;
+	struct iovec	 iov;
+	struct cmsghdr	*c;
+	ssize_t		 nr;
+	uint32_t	 drops;
+	int		 tos;
+
+	*ce = 0;
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = from;
+	mh.msg_namelen = sizeof(*from);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cmsg.buf;
+	mh.msg_controllen = sizeof(cmsg.buf);
+
+	if ((nr = recvmsg(s, &mh, flags)) == -1)
+		return -1;
+
+	/* IP_TOS comes as a byte, IPV6_TCLASS as an int */
+	for (c = CMSG_FIRSTHDR(&mh); c != NULL; c = CMSG_NXTHDR(&mh, c)) {
+#ifdef SO_RXQ_OVFL
+		/* the kernel counts what it dropped for want of room */
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+			tune_drops(drops);
+			continue;
+		}
+#endif
+		if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_TOS)
+			tos = *CMSG_DATA(c);
+		else if (c->cmsg_level == IPPROTO_IPV6 &&
+		    c->cmsg_type == IPV6_TCLASS)
+			memcpy(&tos, CMSG_DATA(c), sizeof(tos));
+		else
+			continue;
+
+		*ce = (tos & IPTOS_ECN_MASK) == IPTOS_ECN_CE;
+	}
+
+	(void)drops;
+	return nr;
+#else
+	socklen_t	 fromlen = sizeof(*from);
+
+	*ce = 0;
+	return recvfrom(s, buf, size, flags, (struct sockaddr *)from,
+	    &fromlen);
+#endif
+}
+
+enum Msg
+msg_control(const uint8_t *const buf, const size_t size,
+    struct peer *const peers)
+{
+	enum {
+		ResetSize = 1 + 4, /* type, epoch, then sizes in reset */
+		ResyncSize = ResetSize + 4 + 2 + 2 + 1
+	};
+	uint32_t	 repoch, rpepoch, datagram, history, window, windowmax;
+	uint32_t	 dedup, spill, npeers;
+	seq_t		 riseq, roseq, seq;
+	int		 i;
+	const uint8_t	*p, *q, *r, *end = buf + size;
+	struct conf	 c = conf;
+	struct chunk	 chunk;
+
+	if (size < ResetSize)
+		return Msg_Bad;
+
+	repoch = buf[1];
+	repoch = (repoch << 8) + buf[2];
+	repoch = (repoch << 8) + buf[3];
+	repoch = (repoch << 8) + buf[4];
+
+	switch (buf[0]) {
+	case Msg_Reset:
+	case Msg_Reset_OK:
+		p = buf + ResetSize;
+		if (repoch == 0)
+			return Msg_Bad;
+		else if (buf[0] == Msg_Reset_OK) {
+			if (size < ResetSize + 4)
+				return Msg_Bad;
+
+			rpepoch = p[0];
+			rpepoch = (rpepoch << 8) + p[1];
+			rpepoch = (rpepoch << 8) + p[2];
+			rpepoch = (rpepoch << 8) + p[3];
+			p += 4;
+
+			/* only an answer to the reset we are waiting on */
+			if (!handshake || rpepoch != epoch)
+				return Msg_Bad;
+		}
+
+		/* the sizes of the other side follow the epoch */
+		if ((p = msg_getvarint(p, end, &datagram)) == NULL ||
+		    (p = msg_getvarint(p, end, &history)) == NULL ||
+		    (p = msg_getvarint(p, end, &window)) == NULL ||
+		    (p = msg_getvarint(p, end, &windowmax)) == NULL ||
+		    (p = msg_getvarint(p, end, &dedup)) == NULL ||
+		    (p = msg_getvarint(p, end, &spill)) == NULL ||
+		    (p = msg_getvarint(p, end, &npeers)) == NULL)
+			return Msg_Bad;
+
+		c.datagram = datagram;
+		c.history = (int)history;
+		c.windowinit = window;
+		c.windowmax = windowmax;
+		c.dedup = dedup;
+		c.spill = spill;
+		if (conf_derive(&c) != NULL || npeers == 0 ||
+		    npeers > StreamSlots)
+			return Msg_Bad;
+
+		/* its stream slots, the ones it does not have are never used */
+		c.peers = (int)npeers;
+
+		/* then the first message of the new session, if any */
+		for (q = p; (r = msg_getchunk(q, end, &chunk)) != NULL; q = r)
+			;
+		if (q != end || (buf[0] == Msg_Reset_OK && p != end))
+			return Msg_Bad;
+
+		/* a resent reset of this session is only answered again */
+		if (buf[0] == Msg_Reset_OK || repoch != pepoch) {
+			if (buf[0] == Msg_Reset && !msg_strike(repoch))
+				return Msg_Bad;
+			else if (!handshake)
+				msg_reset(peers);
+			else if (buf[0] == Msg_Reset && oseq != 0)
+				/* our resets crossed, the first message goes again */
+				OUT_HISTORY(0)->lasttry =
+				    (0x10000 + useq - conf.history) & 0xffff;
+
+			pconf = c;
+			pepoch = repoch;
+			msg_agree(peers);
+		}
+
+		if (buf[0] == Msg_Reset)
+			msg_early(p, end);
+
+		current = 1;
+		return (enum Msg)buf[0];
+	case Msg_Resync:
+	case Msg_Resync_OK:
+		if (size < ResyncSize)
+			return Msg_Bad;
+		break;
+	case Msg_Probe:
+	case Msg_Probe_OK:
+		if (size < 1 + ProbeSize)
+			return Msg_Bad;
+		else if (buf[0] == Msg_Probe)
+			memcpy(response, buf + 1, ProbeSize);
+		else if (path == NULL ||
+		    !msg_samepath(&source, candidate.ai_addr) ||
+		    memcmp(buf + 1, challenge, ProbeSize) != 0)
+			return Msg_Bad;
+		else
+			msg_moveto(&source);
+
+		return (enum Msg)buf[0];
+	default:
+		return Msg_Bad;
+	}
+
+	rpepoch = buf[5];
+	rpepoch = (rpepoch << 8) + buf[6];
+	rpepoch = (rpepoch << 8) + buf[7];
+	rpepoch = (rpepoch << 8) + buf[8];
+	riseq = ((seq_t)buf[9] << 8) + buf[10];
+	roseq = ((seq_t)buf[11] << 8) + buf[12];
+
+	/* the other side must still have the session we have */
+	if (handshake)
+		return Msg_Bad;
+	else if (repoch != pepoch || rpepoch != epoch)
+		return Msg_Stale;
+
+	current = 1;
+	if (DIFF16(oseq, riseq) > session.history ||
+	    DIFF16(roseq, iseq) > session.history)
+		return Msg_Stale;
+
+	for (seq = riseq; seq != oseq; seq = (seq + 1) & 0xffff)
+		if (OUT_HISTORY(seq)->seq != seq)
+			return Msg_Stale;
+
+	/*
+	 * Everything before riseq is processed by the other side, all the
+	 * rest is resent in order, starting as soon as possible.
+	 */
+	for (i = 0; i < session.history; ++i) {
+		struct msg	*const m = &ohist[i];
+		const seq_t	 diff = DIFF16(riseq, m->seq);
+
+		if (m->seq < 0)
+			continue;
+		else if (0 < diff && diff <= session.history)
+			msg_deliver(m);
+		else if (msg_bit(obits, m->seq))
+			m->lasttry = (0x20000 + useq - session.history -
+			    DIFF16(oseq, m->seq)) & 0xffff;
+	}
+
+	if (msg_credit(buf + 13, buf + size, peers) == NULL)
+		return Msg_Bad;
+
+	resyncs = 0;
+	return (enum Msg)buf[0];
+}
+
+const uint8_t *
+msg_report(const uint8_t *const report, const uint8_t *const end,
+    struct peer *const peers)
+{
+	const seq_t	 rnext = ((seq_t)report[0] << 8) + report[1];
+	const uint8_t	*const rmask = report + 2;
+	const int	 d = DIFF16(oseq, rnext);
+	uint64_t	 x;
+	int		 p, k, n, from, to, acked = 0;
+
+	/* what we sent before rnext, of the last history messages */
+	n = d <= session.history ? session.history - d : 0;
+	for (p = 0; p < n; p += 64)
+		acked += msg_ack(oseq + p, n - p < 64 ? n - p : 64, ~(uint64_t)0);
+
+	/* the mask is of the messages after rnext, those we still have */
+	from = d - 1 > session.history ? d - 1 - session.history : 0;
+	to = d - 1 < session.reportcount ? d - 1 : session.reportcount;
+	for (p = 0; p < to; p += 64) {
+		n = session.reportcount - p < 64 ? session.reportcount - p : 64;
+		for (x = 0, k = 0; k < n; k += 8)
+			x |= (uint64_t)rmask[(p + k) >> 3] << k;
+
+		if (from > p)
+			x &= ~LOW_BITS(from - p);
+		if (to - p < n)
+			x &= LOW_BITS(to - p);
+		acked += msg_ack(rnext + 1 + p, n, x);
+	}
+
+	msg_congestion(rnext, rmask[session.masksize], acked);
+	return msg_credit(rmask + session.masksize + 1, end, peers);
+}
+
+size_t
+msg_putreport(uint8_t *const buf, const size_t room,
+    const struct peer *const peers)
+{
+	const int	 w = session.history < 64 ? session.history : 64;
+	size_t		 size = 0;
+	uint64_t	 x = 0;
+	seq_t		 rnext;
+	int		 p, k, n;
+
+	/* the first missing message, a word at a time */
+	for (p = 0; p < session.history; p += w)
+		if ((x = ~msg_bits(ibits, iseq + p, w) & LOW_BITS(w)) != 0)
+			break;
+
+	rnext = (iseq + p + (x != 0 ? __builtin_ctzll(x) : 0)) & 0xffff;
+	buf[size++] = (uint8_t)(rnext >> 8);
+	buf[size++] = (uint8_t)rnext;
+
+	/* past the history the slots are of messages already processed */
+	n = session.history - 1 - DIFF16(rnext, iseq);
+	if (n > session.reportcount)
+		n = session.reportcount;
+
+	memset(buf + size, 0, session.masksize);
+	for (p = 0; p < n; p += 64) {
+		x = msg_bits(ibits, rnext + 1 + p, n - p < 64 ? n - p : 64);
+		for (k = 0; k < 64 && p + k < n; k += 8)
+			buf[size + ((p + k) >> 3)] = (uint8_t)(x >> k);
+	}
+
+	size += session.masksize;
+	buf[size++] = cemarks;
+	size += msg_putcredit(buf + size, room - size, peers);
+	unacked = 0;
+	ackdue -= ackdue > 0;
+	return size;
+}
+
+const uint8_t *
+msg_credit(const uint8_t *p, const uint8_t *const end,
+    struct peer *const peers)
+{
+	uint32_t	 n, id, limit;
+	struct peer	*peer;
+
+	if ((p = msg_getvarint(p, end, &n)) == NULL)
+		return NULL;
+
+	/*
+	 * Credits only grow.  A limit which is too far ahead of what we
+	 * have sent is bogus, so it is ignored.  The peer may spill past
+	 * its window as much as it said in the reset.
+	 */
+	while (n-- > 0) {
+		if ((p = msg_getvarint(p, end, &id)) == NULL ||
+		    (p = msg_getvarint(p, end, &limit)) == NULL)
+			return NULL;
+
+		if ((peer = msg_stream(peers, id)) == NULL || peer->id != id)
+			continue;
+
+		if (DIFF32(limit, peer->send.sent) <= session.windowmax +
+		    pconf.spill &&
+		    DIFF32(limit, peer->send.limit) < 0x80000000)
+			peer->send.limit = limit;
+	}
+
+	return p;
+}
+
+size_t
+msg_putcredit(uint8_t *const buf, const size_t room,
+    const struct peer *const peers)
+{
+	size_t		 size = 0;
+	uint32_t	 n = 0;
+	int		 i, p;
+
+	/* as many streams as fit, starting after the last one sent */
+	for (i = 0; i < session.peers; ++i) {
+		const struct peer *const peer = &peers[(cstart + i) % session.peers];
+		size_t		 need;
+
+		if (!ACTIVE(peer))
+			continue;
+
+		need = msg_varintsize(peer->id);
+		need += msg_varintsize(peer->recv.limit);
+		if (msg_varintsize(n + 1) + size + need > room)
+			break;
+
+		size += need;
+		++n;
+	}
+
+	size = msg_putvarint(buf, n);
+
+	for (p = cstart; n > 0; p = (p + 1) % session.peers) {
+		const struct peer *const peer = &peers[p];
+
+		if (!ACTIVE(peer))
+			continue;
+
+		size += msg_putvarint(buf + size, peer->id);
+		size += msg_putvarint(buf + size, peer->recv.limit);
+		--n;
+	}
+
+	cstart = p;
+	return size;
+}
+
+size_t
+msg_creditsize(const struct peer *const peers)
+{
+	size_t		 size = 3;
+	int		 p;
+
+	for (p = 0; p < session.peers; ++p)
+		if (ACTIVE(&peers[p]))
+			size += CreditMaxSize;
+
+	return size < session.datasize / 4 ? size : session.datasize / 4;
+}
+
+const uint8_t *
+msg_getchunk(const uint8_t *p, const uint8_t *const end,
+    struct chunk *const chunk)
+{
+	uint32_t	 size;
+
+	if (p == end || *p == 0)
+		return NULL;
+	else if ((p = msg_getvarint(p, end, &chunk->id)) == NULL ||
+	    (p = msg_getvarint(p, end, &chunk->offset)) == NULL || p == end)
+		return NULL;
+
+	chunk->flags = *p++;
+	chunk->service = 0;
+
+	if ((chunk->flags & ChunkService) && p != end)
+		chunk->service = *p++ % ServiceMax;
+
+	if ((p = msg_getvarint(p, end, &size)) == NULL ||
+	    (size_t)(end - p) < size)
+		return NULL;
+
+	chunk->size = size;
+	chunk->data = p;
+	return p + size;
+}
+
+struct peer *
+msg_stream(struct peer *const peers, const uint32_t id)
+{
+	const uint32_t	 slot = id & (StreamSlots - 1);
+
+	return slot < (uint32_t)session.peers ? &peers[slot] : NULL;
+}
+
+ssize_t
+msg_chunksize(const struct peer *const peer, const struct chunk *const chunk)
+{
+	/* taken out of order already, see msg_bypass */
+	if (!(chunk->flags & ChunkDedup) && peer->id == chunk->id &&
+	    chunk->offset != peer->recv.total)
+		return 0;
+
+	return chunk->flags & ChunkDedup ?
+	    dedup_size(chunk->data, chunk->size) : (ssize_t)chunk->size;
+}
+
+void
+msg_append(struct peer *const peer, const struct chunk *const chunk,
+    const size_t size)
+{
+	uint8_t		*dst;
+
+	if (!msg_reserve(peer, size))
+		return;
+
+	dst = peer->recv.buf + peer->recv.off + peer->recv.size;
+	if (chunk->flags & ChunkDedup)
+		dedup_decode(chunk->data, chunk->size, dst);
+	else
+		memcpy(dst, chunk->data, chunk->size);
+	peer->recv.size += size;
+	peer->recv.total += (uint32_t)size;
+
+	/* without the file the credit given cannot be kept */
+	if (!spill_push(peer, size))
+		peer->recv.close = 1;
+}
+
+void
+msg_bypass(struct peer *const peers)
+{
+	const uint8_t	*p, *end;
+	struct msg	*msg;
+	struct peer	*peer;
+	struct chunk	 chunk;
+	seq_t		 seq;
+	int		 i;
+
+	/*
+	 * Plain data which follows what a stream has is taken as it comes,
+	 * in order of sequence, so a stream which loses data waits alone.
+	 * Opening, closing and dedup wait for their message, in order.
+	 */
+	for (i = 1; i < session.history; ++i) {
+		seq = (iseq + i) & 0xffff;
+		if ((msg = IN_HISTORY(seq))->seq != seq || msg->data == NULL)
+			continue;
+
+		end = msg->data + msg->size;
+		for (p = msg->data; (p = msg_getchunk(p, end, &chunk)) != NULL; )
+			if (chunk.flags == 0 && chunk.size > 0 &&
+			    (peer = msg_stream(peers, chunk.id)) != NULL &&
+			    peer->id == chunk.id && !peer->free &&
+			    chunk.offset == peer->recv.total)
+				msg_append(peer, &chunk, chunk.size);
+	}
+}
+
+size_t
+msg_putvarint(uint8_t *const buf, uint32_t x)
+{
+	size_t		 size = 0;
+
+	for (; x >= 0x80; x >>= 7)
+		buf[size++] = (uint8_t)(x | 0x80);
+
+	buf[size++] = (uint8_t)x;
+	return size;
+}
+
+size_t
+msg_varintsize(uint32_t x)
+{
+	size_t		 size = 1;
+
+	for (; x >= 0x80; x >>= 7)
+		++size;
+
+	return size;
+}
+
+const uint8_t *
+msg_getvarint(const uint8_t *p, const uint8_t *const end, uint32_t *const x)
+{
+	int		 shift;
+
+	*x = 0;
+	for (shift = 0; p < end && shift < 35; shift += 7) {
+		*x |= (uint32_t)(*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0)
+			return p;
+	}
+
+	return NULL;
+}
+
+int
+msg_reserve(struct peer *const peer, const size_t size)
+{
+	uint8_t		*buf;
+	size_t		 cap;
+
+	if (peer->recv.off + peer->recv.size + size <= peer->recv.cap)
+		return 1;
+	else if (peer->recv.size + size > session.recvbufmax)
+		return 0;
+
+	if (peer->recv.off > 0) {
+		memmove(peer->recv.buf, peer->recv.buf + peer->recv.off,
+		    peer->recv.size);
+		peer->recv.off = 0;
+
+		if (peer->recv.size + size <= peer->recv.cap)
+			return 1;
+	}
+
+	cap = peer->recv.cap > 0 ? peer->recv.cap : session.peermaxsend;
+	while (cap < peer->recv.size + size)
+		cap <<= 1;
+	if (cap > session.recvbufmax)
+		cap = session.recvbufmax;
+
+	if ((buf = realloc(peer->recv.buf, cap)) == NULL)
+		return 0;
+
+	peer->recv.buf = buf;
+	peer->recv.cap = cap;
+	return 1;
+}
+
+void
+msg_autotune(struct peer *const peers)
+{
+	int		 p;
+
+	for (p = 0; p < session.peers; ++p) {
+		struct peer	*const peer = &peers[p];
+		size_t		 window = peer->recv.window;
+		uint32_t	 limit;
+
+		if (window == 0)
+			continue;
+		else if (msg_creditdue(peer))
+			ackdue = 2; /* once more in case the first is lost */
+
+		if (peer->recv.size == 0 && peer->recv.spilled == 0 &&
+		    DIFF32(peer->recv.limit, peer->recv.total) <
+		    session.peermaxsend) {
+			/* consumer is fast, sender is waiting for credit */
+			window <<= 1;
+			peer->recv.slow = 0;
+		} else if (peer->recv.size <= window >> 1)
+			peer->recv.slow = 0;
+		else if (++peer->recv.slow >= conf.frequency) {
+			/* consumer is slow for a second */
+			window >>= 1;
+			peer->recv.slow = 0;
+		}
+
+		if (window < session.windowmin)
+			window = session.windowmin;
+		else if (window > session.windowmax)
+			window = session.windowmax;
+
+		peer->recv.window = window;
+		tune_stream(peer);
+		limit = peer->recv.total - (uint32_t)(peer->recv.size +
+		    peer->recv.spilled) + (uint32_t)(window + conf.spill);
+
+		if (DIFF32(limit, peer->recv.limit) < 0x80000000)
+			peer->recv.limit = limit;
+	}
+}
+
+int
+msg_creditdue(const struct peer *const peer)
+{
+	const size_t	 window = peer->recv.window;
+	const uint32_t	 limit = peer->recv.total - (uint32_t)(peer->recv.size +
+			    peer->recv.spilled) + (uint32_t)(window + conf.spill);
+	const uint32_t	 diff = DIFF32(limit, peer->recv.limit);
+
+	/* the consumer has freed a quarter of the window */
+	return ACTIVE(peer) && window > 0 && diff >= window >> 2 &&
+	    diff < 0x80000000;
+}
+
+size_t
+msg_sendable(const struct peer *const peer)
+{
+	const size_t	 credit = DIFF32(peer->send.limit, peer->send.sent);
+
+	return peer->send.size < credit ? peer->send.size : credit;
+}
+
+int
+msg_pending(const struct peer *const peer)
+{
+	return peer->send.open || msg_sendable(peer) > 0 ||
+	    (peer->send.close && peer->send.size == 0);
+}
+
+int
+msg_urgent(const struct peer *const peer)
+{
+	/* a short stream should not wait for the tick, to open or to end */
+	return peer->send.open ||
+	    (peer->send.close && msg_sendable(peer) == peer->send.size);
+}
+
+int
+msg_idle(const struct peer *const peers)
+{
+	int		 i;
+
+	if (handshake || unacked > 0 || ackdue > 0)
+		return 0;
+
+	for (i = 0; i < (int)RING_WORDS(session.history); ++i)
+		if (obits[i] != 0)
+			return 0;
+
+	for (i = 0; i < session.peers; ++i)
+		if (msg_pending(&peers[i]) || msg_creditdue(&peers[i]))
+			return 0;
+
+	return 1;
+}
+
+void
+msg_congestion(const seq_t rnext, const uint8_t rce, const int acked)
+{
+	const uint8_t	 marks = (uint8_t)(rce - rcemarks);
+
+	/* the mark count is cumulative, reordered reports are stale */
+	if (marks >= 0x80)
+		return;
+
+	rcemarks = rce;
+
+	/* cut once per window, like loss in TCP */
+	if (recover >= 0 && 0 < DIFF16(rnext, recover) &&
+	    DIFF16(rnext, recover) <= session.history)
+		recover = -1;
+
+	if (marks > 0 && recover < 0) {
+		budget >>= 1;
+		if (budget < session.datasize / 8)
+			budget = session.datasize / 8;
+		recover = oseq;
+	} else if (recover < 0) {
+		budget += (size_t)acked * session.datasize / conf.frequency;
+		if (budget > session.datasize)
+			budget = session.datasize;
+	}
+}
+
+void
+msg_sendidle(const int s, const struct peer *const peers,
+    const struct addrinfo *const to)
+{
+	/* the tick passes even if nothing is sent, resends rely on it */
+	if (!msg_pace(0))
+		return;
+
+	useq = (useq + 1) & 0xffff;
+
+	if (unacked > 0 || ackdue > 0)
+		msg_sendmsg(s, NULL, Msg_Ack, peers, to);
+	else if (msg_elapsed(&last_frametime) >= keepalive * (long long)Second) {
+		msg_sendmsg(s, NULL, Msg_Ack, peers, to);
+		if ((keepalive <<= 1) > conf.keepalivemax)
+			keepalive = conf.keepalivemax;
+	}
+}
+
+int
+msg_pace(const int lead)
+{
+	const long long	 exact = Second / conf.frequency;
+	const long long	 td = msg_elapsed(&last_sendtime);
+
+	/* last_sendtime is the departure time, it may be ahead of now */
+	if (td + lead * exact < exact / 2)
+		return 0;
+	else if (td > exact * 3 / 2)
+		clock_gettime(CLOCK_MONOTONIC, &last_sendtime);
+	else if ((last_sendtime.tv_nsec += exact) >= Second) {
+		++last_sendtime.tv_sec;
+		last_sendtime.tv_nsec -= Second;
+	}
+
+	return 1;
+}
+
+long long
+msg_elapsed(const struct timespec *const since)
+{
+	struct timespec	 curtime;
+
+	clock_gettime(CLOCK_MONOTONIC, &curtime);
+	return (curtime.tv_sec - since->tv_sec) * 1000000000LL +
+	    (curtime.tv_nsec - since->tv_nsec);
+}
+
+size_t
+msg_sendlimit(const struct peer *const peers, size_t room)
+{
+	size_t		 low = 0, high = session.peermaxsend;
+	int		 i;
+
+	for (i = 0; i < session.peers; ++i)
+		if (msg_sendable(&peers[i]) > 0)
+			room -= room < ChunkHeaderMax ? room : ChunkHeaderMax;
+
+	while (low < high) {
+		const size_t	 mid = (low + high) >> 1;
+		size_t		 size = 0;
+		int		 i;
+
+		for (i = 0; i < session.peers; ++i) {
+			const size_t	 t = msg_sendable(&peers[i]);
+			size += t < mid ? t : mid;
+		}
+
+		if (size == room)
+			return mid;
+		else if (size < room)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+void
+msg_sendmsg(const int s, struct msg *const msg, const enum Msg type,
+    const struct peer *const peers, const struct addrinfo *const to)
+{
+	const uint32_t	 msgtime = (uint32_t)time(NULL);
+	uint8_t		*const buf = outbuf;
+	size_t		 size;
+
+	/* acks and answers are small and not paced */
+	if (msg != NULL && msg->seq < 0)
+		return;
+	else if (type != Msg_Ack && type != Msg_Reset_OK &&
+	    type != Msg_Probe && type != Msg_Probe_OK &&
+	    type != Msg_Datagram && !msg_pace(type == Msg_OK &&
+	    (txtime || urgent) ? PacingLead : 0))
+		return;
+
+	arc4random_buf(buf, 8);
+	size = 16;
+	buf[size++] = (uint8_t)(msgtime >> 24);
+	buf[size++] = (uint8_t)(msgtime >> 16);
+	buf[size++] = (uint8_t)(msgtime >> 8);
+	buf[size++] = (uint8_t)msgtime;
+	buf[size++] = (uint8_t)type;
+
+	while (epoch == 0)
+		epoch = arc4random();
+
+	/* the connection id is the epoch the other side has chosen */
+	if (type == Msg_OK || type == Msg_Ack || type == Msg_Datagram) {
+		buf[size++] = (uint8_t)(pepoch >> 24);
+		buf[size++] = (uint8_t)(pepoch >> 16);
+		buf[size++] = (uint8_t)(pepoch >> 8);
+		buf[size++] = (uint8_t)pepoch;
+	}
+
+	if (type == Msg_Ack)
+		size += msg_putreport(buf + size, session.datagram - size, peers);
+	else if (type == Msg_Datagram) {
+		memcpy(buf + size, msg->data, msg->size);
+		size += msg->size;
+	} else if (type == Msg_Probe || type == Msg_Probe_OK) {
+		memcpy(buf + size, type == Msg_Probe ? challenge : response,
+		    ProbeSize);
+		size += ProbeSize;
+	} else if (type == Msg_Reset || type == Msg_Reset_OK) {
+		buf[size++] = (uint8_t)(epoch >> 24);
+		buf[size++] = (uint8_t)(epoch >> 16);
+		buf[size++] = (uint8_t)(epoch >> 8);
+		buf[size++] = (uint8_t)epoch;
+
+		/* an answer names the reset it answers */
+		if (type == Msg_Reset_OK) {
+			buf[size++] = (uint8_t)(pepoch >> 24);
+			buf[size++] = (uint8_t)(pepoch >> 16);
+			buf[size++] = (uint8_t)(pepoch >> 8);
+			buf[size++] = (uint8_t)pepoch;
+		}
+
+		size += msg_putvarint(buf + size, (uint32_t)conf.datagram);
+		size += msg_putvarint(buf + size, (uint32_t)conf.history);
+		size += msg_putvarint(buf + size, (uint32_t)conf.windowinit);
+		size += msg_putvarint(buf + size, (uint32_t)conf.windowmax);
+		size += msg_putvarint(buf + size, (uint32_t)conf.dedup);
+		size += msg_putvarint(buf + size, (uint32_t)conf.spill);
+		size += msg_putvarint(buf + size, (uint32_t)conf.peers);
+
+		if (msg != NULL) {
+			msg->lasttry = useq;
+			memcpy(buf + size, msg->data, msg->size);
+			size += msg->size;
+		}
+	} else if (msg == NULL) {
+		buf[size++] = (uint8_t)(epoch >> 24);
+		buf[size++] = (uint8_t)(epoch >> 16);
+		buf[size++] = (uint8_t)(epoch >> 8);
+		buf[size++] = (uint8_t)epoch;
+		buf[size++] = (uint8_t)(pepoch >> 24);
+		buf[size++] = (uint8_t)(pepoch >> 16);
+		buf[size++] = (uint8_t)(pepoch >> 8);
+		buf[size++] = (uint8_t)pepoch;
+		buf[size++] = (uint8_t)(iseq >> 8);
+		buf[size++] = (uint8_t)iseq;
+		buf[size++] = (uint8_t)(oseq >> 8);
+		buf[size++] = (uint8_t)oseq;
+		size += msg_putcredit(buf + size, session.datagram - size, peers);
+	} else {
+		msg->lasttry = useq;
+		useq = (useq + 1) & 0xffff;
+		buf[size++] = (uint8_t)(msg->seq >> 8);
+		buf[size++] = (uint8_t)msg->seq;
+		size += msg_putreport(buf + size,
+		    session.datagram - size - msg->size, peers);
+		memcpy(buf + size, msg->data, msg->size);
+		size += msg->size;
+	}
+
+	if ((type == Msg_OK || type == Msg_Ack) && size < session.datagram) {
+		size_t		 r = session.datagram - size;
+
+		r = r < 15 ? r : 15;
+		r = (ssize_t)arc4random_uniform((uint32_t)r);
+		memset(buf + size, 0, r);
+		size += r;
+	}
+
+#ifdef USE_THREADS
+	worker_send(s, buf, size, to, type == Msg_Ack ||
+	    type == Msg_Datagram ? NULL : &last_sendtime);
+#else
+	msg_seal(buf, size);
+	msg_sendto(s, buf, size, to, type == Msg_Ack ||
+	    type == Msg_Datagram ? NULL : &last_sendtime);
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &last_frametime);
+}
+
+void
+msg_deliver(struct msg *const msg)
+{
+	msg_setbit(obits, msg->seq, 0);
+	msg->sent = 0;
+	msg_free(msg);
+}
+
+void
+msg_sample(const struct msg *const msg)
+{
+	if (msg->sent > 0)
+		tune_rtt(tune_now() - msg->sent);
+
+	tune_count(TuneOut, msg->size);
+}
+
+int
+msg_ack(const seq_t from, const int n, uint64_t x)
+{
+	int		 acked;
+
+	/* x has a bit for each of the n messages from this one */
+	x &= msg_bits(obits, from, n);
+	acked = __builtin_popcountll(x);
+	for (; x != 0; x &= x - 1) {
+		struct msg	*const msg = OUT_HISTORY(from +
+				    __builtin_ctzll(x));
+
+		msg_sample(msg);
+		msg_deliver(msg);
+	}
+
+	return acked;
+}
+
+int
+msg_bit(const uint64_t *const ring, const seq_t seq)
+{
+	const int	 i = seq & (session.history - 1);
+
+	return ring[i >> 6] >> (i & 63) & 1;
+}
+
+void
+msg_setbit(uint64_t *const ring, const seq_t seq, const int on)
+{
+	const int	 i = seq & (session.history - 1);
+
+	if (on)
+		ring[i >> 6] |= (uint64_t)1 << (i & 63);
+	else
+		ring[i >> 6] &= ~((uint64_t)1 << (i & 63));
+}
+
+uint64_t
+msg_bits(const uint64_t *const ring, const seq_t seq, const int n)
+{
+	uint64_t	 x = 0;
+	int		 i, k, m;
+
+	/* n bits from seq on, in pieces which do not cross a word or the end */
+	for (k = 0; k < n; k += m) {
+		i = (seq + k) & (session.history - 1);
+		m = 64 - (i & 63);
+		if (m > session.history - i)
+			m = session.history - i;
+		if (m > n - k)
+			m = n - k;
+		x |= (ring[i >> 6] >> (i & 63) & LOW_BITS(m)) << k;
+	}
+
+	return x;
+}
+
+uint8_t *
+msg_alloc(const size_t size, int *const slab)
+{
+	int		 c;
+
+	if (size > SLAB_SIZE(SlabClasses - 1))
+		return NULL;
+	for (c = 0; SLAB_SIZE(c) < size; ++c)
+		;
+
+	/* a larger object will do if memory is short */
+	for (; c < SlabClasses; ++c) {
+		uint8_t		*obj = slab_free[c];
+
+		if (obj == NULL && !msg_slabgrow(c))
+			continue;
+
+		obj = slab_free[c];
+		memcpy(&slab_free[c], obj, sizeof(void *));
+		*slab = c;
+		return obj;
+	}
+
+	return NULL;
+}
+
+void
+msg_free(struct msg *const msg)
+{
+	if (msg->data == NULL)
+		return;
+
+	memcpy(msg->data, &slab_free[msg->slab], sizeof(void *));
+	slab_free[msg->slab] = msg->data;
+	msg->data = NULL;
+}
+
+int
+msg_slabgrow(const int c)
+{
+	const size_t	 size = SLAB_SIZE(c);
+	uint8_t		*slab;
+	int		 i;
+
+	if ((slab = malloc(SlabObjects * size)) == NULL)
+		return 0;
+
+	for (i = 0; i < SlabObjects; ++i) {
+		memcpy(slab + i * size, &slab_free[c], sizeof(void *));
+		slab_free[c] = slab + i * size;
+	}
+
+	return 1;
+}
@@ -1,68 +1,167 @@
+/* defaults of struct conf, see conf.c */
 enum {
 	OpenMax = 20,
 	DatagramMaxSize = 9216,
-	PeersMax = OpenMax - 2, /* 1 listener + 1 datagram */
-	MessageMaxSize = DatagramMaxSize - 16, /* 8 random + 8 md5 */
 	MessageHistory = 128,
-	ReportSize = 2 + (MessageHistory >> 4), /* seq, bitmask */
-	ReportCount = (ReportSize - 2) << 3,
-	HeaderSize = 6 + ReportSize + 2 * PeersMax,
-	MessageDataMaxSize = MessageMaxSize - HeaderSize,
-	PeerMaxSend = MessageDataMaxSize,
-	PeerRecvBufSize = 3 << 19,
-	MoveSize = 1 << 19,
-	AlertSize = PeerRecvBufSize - (MessageHistory+1) * PeerMaxSend,
-	TimeDiffMax = 300,
+	WindowInit = 8, /* times PeerMaxSend, unless set */
+	WindowMax = 3 << 19,
 	SendFrequency = 40, /* minimum possible value is 2 */
-	ResetAfter = 60 * SendFrequency
+	ResetAfter = 60, /* seconds */
+	AckFrequency = 2, /* ack at least every this many messages */
+	KeepaliveMin = 1, /* seconds, doubled while idle */
+	KeepaliveMax = 32,
+	EjectTime = 10, /* seconds a failing backend is left out, doubled */
+	SockBufMax = 1 << 22 /* largest socket buffer we ask for */
+};
+
+enum {
+	StreamSlots = 1 << 16, /* stream id is generation << 16 | slot */
+	ReportFixed = 2 + 1 + 1, /* seq, ce, credit count, plus the bitmask */
+	HeaderFixed = 4 + 1 + 4 + 2, /* time, type, connection id, seq, report */
+	ProbeSize = 8, /* random token a new path has to echo */
+	ResetHeaderMax = 4 + 1 + 4 + 4 + 7 * 5, /* time, type, epochs, sizes */
+	CreditMaxSize = 5 + 5, /* varint id, varint limit */
+	ChunkHeaderMax = 5 + 5 + 1 + 1 + 3, /* id, offset, flags, service, size */
+	FlowMax = 8, /* datagram flows, each a socket in nstd */
+	TimeDiffMax = 300,
+	PacingLead = 4 /* ticks scheduled ahead when the kernel paces */
 };
 
 enum Msg {
 	Msg_Bad = 0,
 	Msg_OK = 1,
 	Msg_Reset = 2,
-	Msg_Reset_OK = 3
+	Msg_Reset_OK = 3,
+	Msg_Resync = 4,
+	Msg_Resync_OK = 5,
+	Msg_Ack = 6,
+	Msg_Probe = 7,
+	Msg_Probe_OK = 8,
+	Msg_Stale = 9, /* not sent, resync found another session */
+	Msg_Datagram = 10 /* not in sequence, never resent */
+};
+
+enum Chunk {
+	ChunkOpen = 1,
+	ChunkClose = 2,
+	ChunkDedup = 4, /* data is encoded by dedup_encode */
+	ChunkService = 8 /* a service byte follows the flags, on open */
 };
 
 struct peer {
 	char		 free;
-	char		 dontsend;
 	int		 s;
+	uint32_t	 id;
+	int		 service; /* the mapping it came from, see conf.listen */
+	size_t		 sockbuf; /* window the socket is sized for, see tune.c */
 	struct {
 		char		 open;
 		char		 close;
+		char		 shut; /* the close is passed on to the socket */
+		int		 slow;
 		size_t		 off;
 		size_t		 size;
-		uint8_t		 buf[MoveSize + PeerRecvBufSize];
+		size_t		 cap;
+		size_t		 window;
+		uint32_t	 total;
+		uint32_t	 limit;
+		uint8_t		*buf;
+		size_t		 spilloff;
+		size_t		 spilled; /* past the window, see spill.c */
+		uint8_t		*spill;
 	} recv;
 	struct {
 		char		 open;
 		char		 close;
+		char		 shut; /* the socket has nothing more to read */
 		size_t		 size;
-		uint8_t		 buf[PeerMaxSend];
+		uint32_t	 sent;
+		uint32_t	 limit;
+		uint8_t		*buf; /* PeerMaxSend */
 	} send;
 };
 
+/* msg_init: allocate history, buffers and peers as configured */
+struct peer	*msg_init(void);
+
 /* msg_recv: save the incomming message in history */
-enum Msg	 msg_recv(int);
+enum Msg	 msg_recv(int, struct peer *);
+
+/* msg_open: authenticate and decrypt a datagram in place */
+int		 msg_open(uint8_t *, size_t);
+
+/* msg_seal: sign and encrypt a datagram in place */
+void		 msg_seal(uint8_t *, size_t);
 
 /* msg_process: process next received message in order */
 int		 msg_process(struct peer *);
 
-/* msg_send: send a new message */
+/* msg_send: send a new message, an ack or nothing */
 void		 msg_send(int, struct peer *, const struct addrinfo *);
 
-/* msg_sendreset: send a reset request */
+/* msg_sendack: ack received messages if too many are unacked */
+void		 msg_sendack(int, const struct peer *, const struct addrinfo *);
+
+/* msg_sendreset: send a reset request or answer one */
 void		 msg_sendreset(int, enum Msg, const struct addrinfo *);
 
+/* msg_sendresync: send our sequence and window state, 0 if given up */
+int		 msg_sendresync(int, enum Msg, const struct peer *,
+		    const struct addrinfo *);
+
+/* msg_senddgram: send a datagram of a flow now, or drop it */
+void		 msg_senddgram(int, uint32_t, const uint8_t *, size_t,
+		    const struct addrinfo *);
+
 /* msg_resendold: resend an old message if needed */
-int		 msg_resendold(int, const struct addrinfo *);
+int		 msg_resendold(int, const struct peer *, const struct addrinfo *);
 
-/* msg_reset: reset all data */
+/* msg_sendprobe: answer a probe of the path the peer sees us on */
+void		 msg_sendprobe(int, const struct addrinfo *);
+
+/* msg_migrate: follow the peer to a new address once it answers there */
+void		 msg_migrate(struct addrinfo *);
+
+/* msg_reset: reset all data and start a session, answered by Reset_OK */
 void		 msg_reset(struct peer *);
 
+/* msg_save: write the session state for handoff, sockets aside */
+int		 msg_save(FILE *, const struct peer *);
+
+/* msg_load: read the session state of the previous process */
+int		 msg_load(FILE *, struct peer *);
+
+/* msg_reserve: make room for size more bytes of received stream data */
+int		 msg_reserve(struct peer *, size_t);
+
+/* msg_consume: drop data which is written to the local socket */
+void		 msg_consume(struct peer *, size_t);
+
 /* msg_gettimeout: calculate timeout according to SendFrequency */
-struct timeval	*msg_gettimeout(struct timeval *);
+struct timeval	*msg_gettimeout(struct timeval *, const struct peer *);
+
+/* msg_txtime: let the kernel pace the socket, if it can */
+int		 msg_txtime(int);
+
+/* msg_sendto: send a datagram, to leave at the given time if paced */
+void		 msg_sendto(int, const uint8_t *, size_t, const struct addrinfo *,
+		    const struct timespec *);
+
+/* msg_ecn: mark datagrams ECN capable and report congestion marks */
+int		 msg_ecn(int, const struct addrinfo *);
+
+/* msg_putvarint: write x in 7 bit groups, low first */
+size_t		 msg_putvarint(uint8_t *, uint32_t);
+
+/* msg_varintsize: bytes msg_putvarint takes for x */
+size_t		 msg_varintsize(uint32_t);
+
+/* msg_getvarint: read a varint, NULL if it does not end before end */
+const uint8_t	*msg_getvarint(const uint8_t *, const uint8_t *, uint32_t *);
+
+/* msg_recvce: receive a datagram, its source and whether it was marked CE */
+ssize_t		 msg_recvce(int, uint8_t *, size_t, int, int *,
+		    struct sockaddr_storage *);
 
 extern const struct addrinfo
 	client_ai, server_ai, listen_ai, connect_ai;
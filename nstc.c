@@ -21,81 +21,174 @@
 #include <sys/types.h>
 
 #include <err.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "conf.h"
 #include "msg.h"
+#include "dgram.h"
+#include "handoff.h"
+#include "spill.h"
+#include "spin.h"
+#include "tune.h"
+#include "uring.h"
+#include "worker.h"
+
+#define socket(a)	socket(a->ai_family,a->ai_socktype,a->ai_protocol)
+#define bind(s,a)	bind(s, a->ai_addr, a->ai_addrlen)
+#ifdef USE_IO_URING
+#define select(r,w,t)	uring_select(conf.openmax, r, w, NULL, t)
+#elif defined(USE_BUSY_POLL)
+#define select(r,w,t)	spin_select(conf.openmax, r, w, NULL, t)
+#else
+#define select(r,w,t)	select(conf.openmax, r, w, NULL, t)
+#endif
 
-#define socket(a)	socket(a.ai_family,a.ai_socktype,a.ai_protocol)
-#define bind(s,a)	bind(s, a.ai_addr, a.ai_addrlen)
-#define select(r,w,t)	select(OpenMax, r, w, NULL, t)
-
-void		 send_reset(int, enum Msg);
-void		 recv_message(int, int, struct timeval *);
+void		 usage(void);
+int		 send_resync(int, enum Msg);
+void		 recv_message(int, struct timeval *);
+void		 accept_stream(int, int);
+int		 free_slot(void);
 void		 proc_message(void);
 
-struct peer	 peer[PeersMax];
+struct peer	*peer;
+int		 hand_s = -1;
+int		 listen_s[ServiceMax]; /* by service, -1 if none */
 
 int
-main(void)
+main(int argc, char *argv[])
 {
-	struct rlimit	 nofile = { OpenMax, OpenMax };
-	int		 udp_s, tcp_s;
-	int		 i, resend_c = ResetAfter;
+	struct rlimit	 nofile;
+#ifdef USE_PLEDGE
+	char		 promises[64];
+#endif
+	int		 udp_s;
+	int		 i, ch, resend_c, resetafter, taken = 0, on = 1;
+
+	while ((ch = getopt(argc, argv, "f:o:")) != -1) {
+		switch (ch) {
+		case 'f':
+			conf_load(optarg);
+			break;
+		case 'o':
+			conf_set(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc)
+		usage();
+
+	/* flows have their sockets in nstd */
+	conf.udpconnect = NULL;
+	conf_check();
+	resetafter = conf.resetafter * conf.frequency;
+	resend_c = 0;
+	nofile.rlim_cur = nofile.rlim_max = (rlim_t)conf.openmax;
 
 	if (setrlimit(RLIMIT_NOFILE, &nofile) == -1)
 		err(1, "setrlimit");
-	for (i = 0; i < OpenMax; ++i)
+	/* a stream closed under us is an error of send, not a signal */
+	signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < conf.openmax; ++i)
 		if (i != STDERR_FILENO)
 			close(i);
-	for (i = 0; i < PeersMax; ++i)
-		peer[i].s = -1;
+	if ((peer = msg_init()) == NULL)
+		err(1, "msg_init");
 #ifdef USE_UNVEIL
 	if (unveil("/", "") == -1)
 		err(1, "unveil");
+	if (conf.handoff != NULL && unveil(conf.handoff, "rwc") == -1)
+		err(1, "unveil");
+	if (conf.spill > 0 && unveil(conf.spilldir, "rwc") == -1)
+		err(1, "unveil");
 	if (unveil(NULL, NULL) == -1)
 		err(1, "unveil");
 #endif
 #ifdef USE_PLEDGE
-	if (pledge("stdio inet", NULL) == -1)
+	snprintf(promises, sizeof(promises), "stdio inet%s%s",
+	    conf.handoff != NULL ? " unix cpath sendfd recvfd" : "",
+	    conf.spill > 0 ? " rpath wpath cpath" : "");
+	if (pledge(promises, NULL) == -1)
 		err(1, "pledge");
 #endif
+#ifdef USE_IO_URING
+	if (uring_init() == -1)
+		err(1, "io_uring");
+#endif
+#ifdef USE_THREADS
+	if (worker_start() == -1)
+		err(1, "worker_start");
+#endif
+
+	if (conf.handoff != NULL &&
+	    (taken = handoff_take(conf.handoff, &udp_s, listen_s, peer)) == -1)
+		errx(1, "handoff failed");
+
+	if (!taken) {
+		if ((udp_s = socket(conf.client)) == -1)
+			err(1, "socket");
+		if (bind(udp_s, conf.client) == -1)
+			err(1, "bind");
+		for (i = 0; i < ServiceMax; ++i) {
+			listen_s[i] = -1;
+			if (conf.listen[i] == NULL)
+				continue;
+			else if ((listen_s[i] = socket(conf.listen[i])) == -1)
+				err(1, "socket");
+
+			/* closed streams linger, a restart must not wait */
+			setsockopt(listen_s[i], SOL_SOCKET, SO_REUSEADDR, &on,
+			    sizeof(on));
+			if (bind(listen_s[i], conf.listen[i]) == -1)
+				err(1, "bind");
+			else if (listen(listen_s[i], SOMAXCONN) == -1 ||
+			    fcntl(listen_s[i], F_SETFL, O_NONBLOCK) == -1)
+				err(1, "listen");
+		}
+	}
 
-	if ((udp_s = socket(client_ai)) == -1)
-		err(1, "socket");
-	if (bind(udp_s, client_ai) == -1)
-		err(1, "bind");
+	if (conf.udplisten != NULL && dgram_s == -1 && dgram_listen() == -1)
+		err(1, "udplisten");
 
-	if ((tcp_s = socket(listen_ai)) == -1)
-		err(1, "socket");
-	if (bind(tcp_s, listen_ai) == -1)
-		err(1, "bind");
-	if (listen(tcp_s, 2) == -1)
-		err(1, "listen");
+	msg_txtime(udp_s); /* the timer paces if the kernel cannot */
+	msg_ecn(udp_s, conf.client);
+#ifdef USE_BUSY_POLL
+	if (spin_init(udp_s) == -1)
+		err(1, "busypoll");
+#endif
+	if (conf.handoff != NULL &&
+	    (hand_s = handoff_listen(conf.handoff)) == -1)
+		err(1, "%s", conf.handoff);
 
-	send_reset(udp_s, Msg_Reset);
-	msg_reset(peer);
+	if (!taken)
+		msg_reset(peer);
 	close(STDERR_FILENO); /* we need that filedescriptor :D */
 
 	for (;;) {
 		struct timeval	 timeout;
 
-		if (resend_c >= ResetAfter) {
+		if (resend_c >= resetafter) {
 			resend_c = 0;
-			send_reset(udp_s, Msg_Reset);
-			msg_reset(peer);
-		} else if (msg_gettimeout(&timeout)) {
-			recv_message(udp_s, tcp_s, &timeout);
+			if (!send_resync(udp_s, Msg_Resync))
+				msg_reset(peer);
+		} else if (msg_gettimeout(&timeout, peer)) {
+			recv_message(udp_s, &timeout);
 			proc_message();
-		} else if (msg_resendold(udp_s, &server_ai)) {
+		} else if (msg_resendold(udp_s, peer, conf.server)) {
 			++resend_c;
 		} else {
 			resend_c = 0;
-			msg_send(udp_s, peer, &server_ai);
+			msg_send(udp_s, peer, conf.server);
 		}
 	}
 
@@ -103,28 +196,42 @@ main(void)
 }
 
 void
-send_reset(const int s, enum Msg msg)
+usage(void)
+{
+	fprintf(stderr, "usage: nstc [-f file] [-o setting]\n");
+	exit(1);
+}
+
+int
+send_resync(const int s, enum Msg msg)
 {
 	fd_set		 fds;
 	struct timeval	 timeout;
 
 	for (;;) {
-		if (msg_gettimeout(&timeout) == NULL) {
-			msg_sendreset(s, msg, &server_ai);
-			if (msg == Msg_Reset_OK)
-				return;
+		if (msg_gettimeout(&timeout, NULL) == NULL) {
+			if (!msg_sendresync(s, msg, peer, conf.server))
+				return 0;
+			else if (msg == Msg_Resync_OK)
+				return 1;
 		} else {
 			FD_ZERO(&fds);
 			FD_SET(s, &fds);
 			if (select(&fds, NULL, &timeout) < 1)
 				continue;
 
-			switch (msg_recv(s)) {
-			case Msg_Reset:
-				msg = Msg_Reset_OK;
+			switch (msg_recv(s, peer)) {
+			case Msg_Resync:
+				msg = Msg_Resync_OK;
 				break;
-			case Msg_Reset_OK:
-				return;
+			case Msg_Resync_OK:
+				return 1;
+			case Msg_Reset:
+				/* the other side started a new session */
+				msg_sendreset(s, Msg_Reset_OK, conf.server);
+				return 1;
+			case Msg_Stale:
+				return 0;
 			default:
 				break;
 			}
@@ -133,66 +240,70 @@ send_reset(const int s, enum Msg msg)
 }
 
 void
-recv_message(const int udp_s, const int tcp_s,
-    struct timeval *const timeout)
+recv_message(const int udp_s, struct timeval *const timeout)
 {
 	fd_set		 rfds, wfds;
-	int		 i;
+	int		 i, k;
 
 	FD_ZERO(&rfds);
 	FD_ZERO(&wfds);
 	FD_SET(udp_s, &rfds);
+	if (hand_s != -1)
+		FD_SET(hand_s, &rfds);
+	dgram_fdset(&rfds);
 
-	for (i = 0; i < PeersMax; ++i) {
-		if (peer[i].free)
-			FD_SET(tcp_s, &rfds);
+	/* new connections wait in the backlog until a slot is clean */
+	for (k = 0; k < ServiceMax && free_slot() != -1; ++k)
+		if (listen_s[k] != -1)
+			FD_SET(listen_s[k], &rfds);
+
+	for (i = 0; i < session.peers; ++i) {
 		if (peer[i].s == -1)
 			continue;
 
-		if (peer[i].send.size < PeerMaxSend)
+		if (!peer[i].send.shut && peer[i].send.size < session.peermaxsend)
 			FD_SET(peer[i].s, &rfds);
-		if (peer[i].recv.size > 0 || peer[i].recv.close)
+		if (peer[i].recv.size > 0 ||
+		    (peer[i].recv.close && !peer[i].recv.shut))
 			FD_SET(peer[i].s, &wfds);
 	}
 
 	if (select(&rfds, &wfds, timeout) < 1)
 		return;
 
+	if (hand_s != -1 && FD_ISSET(hand_s, &rfds) &&
+	    handoff_give(hand_s, udp_s, listen_s, peer))
+		exit(0);
+
 	if (FD_ISSET(udp_s, &rfds)) {
-		if (msg_recv(udp_s) == Msg_Reset) {
-			send_reset(udp_s, Msg_Reset_OK);
+		switch (msg_recv(udp_s, peer)) {
+		case Msg_Reset:
+			msg_sendreset(udp_s, Msg_Reset_OK, conf.server);
+			return;
+		case Msg_Resync:
+			if (send_resync(udp_s, Msg_Resync_OK))
+				break;
+			/* FALLTHROUGH */
+		case Msg_Stale:
 			msg_reset(peer);
 			return;
+		case Msg_Probe:
+			/* the server checks the address it sees us on */
+			msg_sendprobe(udp_s, conf.server);
+			break;
+		default:
+			msg_sendack(udp_s, peer, conf.server);
+			break;
 		}
 	}
 
-	if (FD_ISSET(tcp_s, &rfds)) {
-		struct sockaddr	 addr;
-		socklen_t	 addrlen = (socklen_t)sizeof(addr);
-		int		 s;
-
-		s = accept(tcp_s, &addr, &addrlen);
-		for (i = 0; i < PeersMax; ++i) {
-			if (peer[i].free && s != -1) {
-				peer[i].free = 0;
-				peer[i].dontsend = 0;
-				peer[i].s = s;
-				peer[i].recv.open = 0;
-				peer[i].recv.close = 0;
-				peer[i].recv.off = 0;
-				peer[i].recv.size = 0;
-				peer[i].send.open = 1;
-				peer[i].send.close = 0;
-				peer[i].send.size = 0;
-				s = -1;
-			}
-		}
+	dgram_recv(&rfds, udp_s, conf.server);
 
-		if (s != -1)
-			close(s);
-	}
+	for (k = 0; k < ServiceMax; ++k)
+		if (listen_s[k] != -1 && FD_ISSET(listen_s[k], &rfds))
+			accept_stream(listen_s[k], k);
 
-	for (i = 0; i < PeersMax; ++i) {
+	for (i = 0; i < session.peers; ++i) {
 		int		 s = peer[i].s;
 
 		if (s != -1 && FD_ISSET(s, &rfds)) {
@@ -200,10 +311,14 @@ recv_message(const int udp_s, const int tcp_s,
 			size_t		 off = peer[i].send.size;
 			ssize_t		 nr;
 
-			nr = recv(s, buf + off, PeerMaxSend - off, 0);
+			nr = recv(s, buf + off, session.peermaxsend - off, 0);
 			if (nr == -1)
 				s = -1;
-			else
+			else if (nr == 0) {
+				/* the other way goes on until its close */
+				peer[i].send.shut = 1;
+				peer[i].send.close = 1;
+			} else
 				peer[i].send.size += (size_t)nr;
 		}
 
@@ -213,36 +328,97 @@ recv_message(const int udp_s, const int tcp_s,
 			size_t		 size = peer[i].recv.size;
 			ssize_t		 nw;
 
-			if (size == 0 ||
-			    (nw = send(s, buf + off, size, 0)) == -1)
+			if (size == 0) {
+				shutdown(s, SHUT_WR);
+				peer[i].recv.shut = 1;
+			} else if ((nw = send(s, buf + off, size, 0)) == -1)
 				s = -1;
-			else {
-				off += (size_t)nw;
-				size -= (size_t)nw;
-
-				if (off >= MoveSize) {
-					memmove(buf, buf + off, size);
-					off = 0;
-				}
-
-				peer[i].recv.off = off;
-				peer[i].recv.size = size;
-			}
+			else
+				msg_consume(&peer[i], (size_t)nw);
 		}
 
+		if (peer[i].send.shut && peer[i].recv.shut)
+			s = -1;
+
 		if (s == -1 && peer[i].s != -1) {
 			close(peer[i].s);
 			peer[i].s = -1;
-			peer[i].send.close = 1;
+			if (!peer[i].send.shut)
+				peer[i].send.close = 1;
 
-			if (peer[i].recv.close) {
-				peer[i].free = 1;
-				peer[i].recv.close = 0;
-			}
+			/* late chunks have the old generation, they are ignored */
+			peer[i].free = 1;
+			peer[i].recv.close = 0;
 		}
 	}
 }
 
+void
+accept_stream(const int l, const int service)
+{
+	struct sockaddr	 addr;
+	socklen_t	 addrlen;
+	ssize_t		 nr;
+	int		 i, s;
+
+	/* the listener does not block, a burst is taken at once */
+	while ((i = free_slot()) != -1) {
+		addrlen = (socklen_t)sizeof(addr);
+		if ((s = accept(l, &addr, &addrlen)) == -1)
+			return;
+
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL) & ~O_NONBLOCK);
+		spill_drop(&peer[i]);
+		tune_open(s);
+		peer[i].free = 0;
+		peer[i].s = s;
+		peer[i].service = service;
+		peer[i].sockbuf = 0;
+		peer[i].id += StreamSlots; /* next generation */
+		if (peer[i].id < StreamSlots)
+			peer[i].id += StreamSlots;
+		peer[i].recv.open = 0;
+		peer[i].recv.close = 0;
+		peer[i].recv.shut = 0;
+		peer[i].recv.slow = 0;
+		peer[i].recv.off = 0;
+		peer[i].recv.size = 0;
+		peer[i].recv.window = session.windowinit;
+		peer[i].recv.total = 0;
+		peer[i].recv.limit = (uint32_t)session.windowinit;
+		peer[i].send.open = 1;
+		peer[i].send.close = 0;
+		peer[i].send.shut = 0;
+		peer[i].send.size = 0;
+		peer[i].send.sent = 0;
+		peer[i].send.limit = (uint32_t)session.windowinit;
+
+		/* what came with the connection goes with the open */
+		nr = recv(s, peer[i].send.buf, session.peermaxsend,
+		    MSG_DONTWAIT);
+		if (nr > 0)
+			peer[i].send.size = (size_t)nr;
+		else if (nr == 0) {
+			peer[i].send.shut = 1;
+			peer[i].send.close = 1;
+		}
+	}
+}
+
+int
+free_slot(void)
+{
+	int		 i;
+
+	/* the tail and the close of the old stream must go first */
+	for (i = 0; i < session.peers; ++i)
+		if (peer[i].free && !peer[i].send.close &&
+		    peer[i].send.size == 0)
+			return i;
+
+	return -1;
+}
+
 void
 proc_message(void)
 {
@@ -253,7 +429,7 @@ proc_message(void)
 
 	while (msg_process(peer)) ;
 
-	for (i = 0; i < PeersMax; ++i) {
+	for (i = 0; i < session.peers; ++i) {
 		int		 s = peer[i].s;
 
 		if (s == -1 && peer[i].recv.close) {
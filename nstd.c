@@ -23,73 +23,167 @@
 #include <err.h>
 #include <errno.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "conf.h"
 #include "msg.h"
+#include "dgram.h"
+#include "handoff.h"
+#include "pool.h"
+#include "spin.h"
+#include "tune.h"
+#include "uring.h"
+#include "worker.h"
+
+#define socket(a)	socket(a->ai_family,a->ai_socktype,a->ai_protocol)
+#define bind(s,a)	bind(s, a->ai_addr, a->ai_addrlen)
+#ifdef USE_IO_URING
+#define select(r,w,t)	uring_select(conf.openmax, r, w, NULL, t)
+#elif defined(USE_BUSY_POLL)
+#define select(r,w,t)	spin_select(conf.openmax, r, w, NULL, t)
+#else
+#define select(r,w,t)	select(conf.openmax, r, w, NULL, t)
+#endif
 
-#define socket(a)	socket(a.ai_family,a.ai_socktype,a.ai_protocol)
-#define bind(s,a)	bind(s, a.ai_addr, a.ai_addrlen)
-#define connect(s,a)	connect(s, a.ai_addr, a.ai_addrlen)
-#define select(r,w,t)	select(OpenMax, r, w, NULL, t)
-
-void		 send_reset(int, enum Msg);
+void		 usage(void);
+int		 send_resync(int, enum Msg);
 void		 recv_message(int, struct timeval *);
 void		 proc_message(void);
+void		 connect_stream(int, int);
 
-struct peer	 peer[PeersMax];
+struct peer	*peer;
+int		 hand_s = -1;
+struct sockaddr_storage client_addr;
+struct addrinfo	 client; /* conf.client until the client moves */
 
 int
-main(void)
+main(int argc, char *argv[])
 {
-	struct rlimit	 nofile = { OpenMax, OpenMax };
+	struct rlimit	 nofile;
+#ifdef USE_PLEDGE
+	char		 promises[64];
+#endif
 	int		 udp_s;
-	int		 i, resend_c = ResetAfter;
+	int		 i, ch, resend_c, resetafter, taken = 0;
+
+	while ((ch = getopt(argc, argv, "f:o:")) != -1) {
+		switch (ch) {
+		case 'f':
+			conf_load(optarg);
+			break;
+		case 'o':
+			conf_set(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc)
+		usage();
+
+	/* listeners are of nstc, they must not take slots here */
+	for (i = 0; i < ServiceMax; ++i)
+		conf.listen[i] = NULL;
+	conf.udplisten = NULL;
+	conf.reserved = 1; /* stderr is kept for warnings */
+	conf_check();
+	resetafter = conf.resetafter * conf.frequency;
+	resend_c = 0;
+	nofile.rlim_cur = nofile.rlim_max = (rlim_t)conf.openmax;
 
 	if (setrlimit(RLIMIT_NOFILE, &nofile) == -1)
 		err(1, "setrlimit");
-	for (i = 0; i < OpenMax; ++i)
+	/* a stream closed under us is an error of send, not a signal */
+	signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < conf.openmax; ++i)
 		if (i != STDERR_FILENO)
 			close(i);
-	for (i = 0; i < PeersMax; ++i)
-		peer[i].s = -1;
+	if ((peer = msg_init()) == NULL)
+		err(1, "msg_init");
+	if (pool_init() == -1)
+		err(1, "pool_init");
 #ifdef USE_UNVEIL
 	if (unveil("/", "") == -1)
 		err(1, "unveil");
+	if (conf.handoff != NULL && unveil(conf.handoff, "rwc") == -1)
+		err(1, "unveil");
+	if (conf.spill > 0 && unveil(conf.spilldir, "rwc") == -1)
+		err(1, "unveil");
 	if (unveil(NULL, NULL) == -1)
 		err(1, "unveil");
 #endif
 #ifdef USE_PLEDGE
-	if (pledge("stdio inet", NULL) == -1)
+	snprintf(promises, sizeof(promises), "stdio inet%s%s",
+	    conf.handoff != NULL ? " unix cpath sendfd recvfd" : "",
+	    conf.spill > 0 ? " rpath wpath cpath" : "");
+	if (pledge(promises, NULL) == -1)
 		err(1, "pledge");
 #endif
+#ifdef USE_IO_URING
+	if (uring_init() == -1)
+		err(1, "io_uring");
+#endif
+#ifdef USE_THREADS
+	if (worker_start() == -1)
+		err(1, "worker_start");
+#endif
 
-	if ((udp_s = socket(server_ai)) == -1)
-		err(1, "socket");
-	if (bind(udp_s, server_ai) == -1)
-		err(1, "bind");
+	client = *conf.client;
+	client.ai_addr = (struct sockaddr *)&client_addr;
+	client.ai_next = NULL;
+	memcpy(&client_addr, conf.client->ai_addr, conf.client->ai_addrlen);
+	msg_migrate(&client);
+
+	if (conf.handoff != NULL &&
+	    (taken = handoff_take(conf.handoff, &udp_s, NULL, peer)) == -1)
+		errx(1, "handoff failed");
+
+	for (i = 0; taken && i < conf.peers; ++i)
+		if (peer[i].s != -1)
+			pool_adopt(i, peer);
+
+	if (!taken) {
+		if ((udp_s = socket(conf.server)) == -1)
+			err(1, "socket");
+		if (bind(udp_s, conf.server) == -1)
+			err(1, "bind");
+	}
+
+	msg_txtime(udp_s); /* the timer paces if the kernel cannot */
+	msg_ecn(udp_s, conf.server);
+#ifdef USE_BUSY_POLL
+	if (spin_init(udp_s) == -1)
+		err(1, "busypoll");
+#endif
+	if (conf.handoff != NULL &&
+	    (hand_s = handoff_listen(conf.handoff)) == -1)
+		err(1, "%s", conf.handoff);
 
-	send_reset(udp_s, Msg_Reset);
-	msg_reset(peer);
+	if (!taken)
+		msg_reset(peer);
 
 	for (;;) {
 		struct timeval	 timeout;
 
-		if (resend_c >= ResetAfter) {
+		if (resend_c >= resetafter) {
 			resend_c = 0;
-			send_reset(udp_s, Msg_Reset);
-			msg_reset(peer);
-		} else if (msg_gettimeout(&timeout)) {
+			if (!send_resync(udp_s, Msg_Resync))
+				msg_reset(peer);
+		} else if (msg_gettimeout(&timeout, peer)) {
 			recv_message(udp_s, &timeout);
 			proc_message();
-		} else if (msg_resendold(udp_s, &client_ai)) {
+		} else if (msg_resendold(udp_s, peer, &client)) {
 			++resend_c;
 		} else {
 			resend_c = 0;
-			msg_send(udp_s, peer, &client_ai);
+			msg_send(udp_s, peer, &client);
 		}
 	}
 
@@ -97,28 +191,42 @@ main(void)
 }
 
 void
-send_reset(const int s, enum Msg msg)
+usage(void)
+{
+	fprintf(stderr, "usage: nstd [-f file] [-o setting]\n");
+	exit(1);
+}
+
+int
+send_resync(const int s, enum Msg msg)
 {
 	fd_set		 fds;
 	struct timeval	 timeout;
 
 	for (;;) {
-		if (msg_gettimeout(&timeout) == NULL) {
-			msg_sendreset(s, msg, &client_ai);
-			if (msg == Msg_Reset_OK)
-				return;
+		if (msg_gettimeout(&timeout, NULL) == NULL) {
+			if (!msg_sendresync(s, msg, peer, &client))
+				return 0;
+			else if (msg == Msg_Resync_OK)
+				return 1;
 		} else {
 			FD_ZERO(&fds);
 			FD_SET(s, &fds);
 			if (select(&fds, NULL, &timeout) < 1)
 				continue;
 
-			switch (msg_recv(s)) {
-			case Msg_Reset:
-				msg = Msg_Reset_OK;
+			switch (msg_recv(s, peer)) {
+			case Msg_Resync:
+				msg = Msg_Resync_OK;
 				break;
-			case Msg_Reset_OK:
-				return;
+			case Msg_Resync_OK:
+				return 1;
+			case Msg_Reset:
+				/* the other side started a new session */
+				msg_sendreset(s, Msg_Reset_OK, &client);
+				return 1;
+			case Msg_Stale:
+				return 0;
 			default:
 				break;
 			}
@@ -135,41 +243,85 @@ recv_message(const int udp_s, struct timeval *const timeout)
 	FD_ZERO(&rfds);
 	FD_ZERO(&wfds);
 	FD_SET(udp_s, &rfds);
+	if (hand_s != -1)
+		FD_SET(hand_s, &rfds);
+	dgram_fdset(&rfds);
 
-	for (i = 0; i < PeersMax; ++i) {
+	for (i = 0; i < session.peers; ++i) {
 		if (peer[i].s == -1)
 			continue;
+		else if (pool_connecting(i)) {
+			FD_SET(peer[i].s, &wfds);
+			continue;
+		}
 
-		if (peer[i].send.size < PeerMaxSend)
+		if (!peer[i].send.shut && peer[i].send.size < session.peermaxsend)
 			FD_SET(peer[i].s, &rfds);
-		if (peer[i].recv.size > 0 || peer[i].recv.close)
+		if (peer[i].recv.size > 0 ||
+		    (peer[i].recv.close && !peer[i].recv.shut))
 			FD_SET(peer[i].s, &wfds);
 	}
 
-	if (select(&rfds, &wfds, timeout) < 1)
-		return;
+	/* with nothing ready a connect may still be late */
+	if (select(&rfds, &wfds, timeout) < 1) {
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+	}
+
+	if (hand_s != -1 && FD_ISSET(hand_s, &rfds)) {
+		/* a connect in progress is not handed over, the stream fails */
+		for (i = 0; i < session.peers; ++i)
+			if (peer[i].s != -1 && pool_connecting(i)) {
+				pool_cancel(i, peer);
+				peer[i].s = -1;
+				connect_stream(i, 0);
+			}
+		if (handoff_give(hand_s, udp_s, NULL, peer))
+			exit(0);
+	}
 
 	if (FD_ISSET(udp_s, &rfds)) {
-		if (msg_recv(udp_s) == Msg_Reset) {
-			send_reset(udp_s, Msg_Reset_OK);
+		switch (msg_recv(udp_s, peer)) {
+		case Msg_Reset:
+			msg_sendreset(udp_s, Msg_Reset_OK, &client);
+			return;
+		case Msg_Resync:
+			if (send_resync(udp_s, Msg_Resync_OK))
+				break;
+			/* FALLTHROUGH */
+		case Msg_Stale:
 			msg_reset(peer);
 			return;
+		default:
+			msg_sendack(udp_s, peer, &client);
+			break;
 		}
 	}
 
-	for (i = 0; i < PeersMax; ++i) {
+	dgram_recv(&rfds, udp_s, &client);
+
+	for (i = 0; i < session.peers; ++i) {
 		int		 s = peer[i].s;
 		errno = 0;
 
+		if (s != -1 && pool_connecting(i)) {
+			connect_stream(i, FD_ISSET(s, &wfds));
+			continue;
+		}
+
 		if (s != -1 && FD_ISSET(s, &rfds)) {
 			uint8_t		*buf = peer[i].send.buf;
 			size_t		 off = peer[i].send.size;
 			ssize_t		 nr;
 
-			nr = recv(s, buf + off, PeerMaxSend - off, 0);
+			nr = recv(s, buf + off, session.peermaxsend - off, 0);
 			if (nr == -1)
 				s = -1;
-			else
+			else if (nr == 0) {
+				/* the other way goes on until its close */
+				peer[i].send.shut = 1;
+				peer[i].send.close = 1;
+			} else
 				peer[i].send.size += (size_t)nr;
 		}
 
@@ -179,28 +331,24 @@ recv_message(const int udp_s, struct timeval *const timeout)
 			size_t		 size = peer[i].recv.size;
 			ssize_t		 nw;
 
-			if (size == 0 ||
-			    (nw = send(s, buf + off, size, 0)) == -1)
+			if (size == 0) {
+				shutdown(s, SHUT_WR);
+				peer[i].recv.shut = 1;
+			} else if ((nw = send(s, buf + off, size, 0)) == -1)
 				s = -1;
-			else {
-				off += (size_t)nw;
-				size -= (size_t)nw;
-
-				if (off >= MoveSize) {
-					memmove(buf, buf + off, size);
-					off = 0;
-				}
-
-				peer[i].recv.off = off;
-				peer[i].recv.size = size;
-			}
+			else
+				msg_consume(&peer[i], (size_t)nw);
 		}
 
+		if (peer[i].send.shut && peer[i].recv.shut)
+			s = -1;
+
 		if (s == -1 && peer[i].s != -1) {
 			warn("peer %d closed", i);
 			close(peer[i].s);
 			peer[i].s = -1;
-			peer[i].send.close = 1;
+			if (!peer[i].send.shut)
+				peer[i].send.close = 1;
 
 			if (peer[i].recv.close) {
 				peer[i].free = 1;
@@ -220,30 +368,24 @@ proc_message(void)
 
 	while (msg_process(peer)) ;
 
-	for (i = 0; i < PeersMax; ++i) {
+	for (i = 0; i < session.peers; ++i) {
 		int		 s = peer[i].s;
 
+		/* an open may come with all of its data and the close */
 		if (s == -1 && peer[i].recv.open) {
-			if (peer[i].recv.close)
-				warnx("open/close %d", i);
-
-			if ((s = socket(connect_ai)) == -1)
-				warn("socket");
-			else if (connect(s, connect_ai) == -1) {
-				warn("connect");
-				close(s);
-				s = -1;
-			}
-
+			s = pool_connect(i, peer);
 			peer[i].free = 0;
 			peer[i].s = s;
+			peer[i].sockbuf = 0;
 			peer[i].recv.open = 0;
+			peer[i].send.close = 0;
 			peer[i].send.size = 0;
+			peer[i].send.sent = 0;
+			peer[i].send.limit = (uint32_t)session.windowinit;
 
+			/* what comes meanwhile waits for the connect */
 			if (s == -1)
-				peer[i].send.close = 1;
-			else
-				warnx("peer %d connected", i);
+				connect_stream(i, 0);
 		}
 
 		if (s == -1 && peer[i].recv.close) {
@@ -252,3 +394,30 @@ proc_message(void)
 		}
 	}
 }
+
+void
+connect_stream(const int i, const int ready)
+{
+	int		 s = peer[i].s, error;
+
+	if (s != -1 && (s = pool_finish(i, ready, peer)) != -1) {
+		peer[i].s = s;
+		if (!pool_connecting(i)) {
+			tune_open(s);
+			warnx("peer %d connected", i);
+		}
+		return;
+	}
+
+	/* every backend failed, the stream is closed */
+	if ((error = pool_error(i)) != 0)
+		warnx("peer %d: connect: %s", i, strerror(error));
+	else
+		warnx("peer %d: no backend to connect to", i);
+	peer[i].s = -1;
+	peer[i].send.close = 1;
+	if (peer[i].recv.close) {
+		peer[i].free = 1;
+		peer[i].recv.close = 0;
+	}
+}
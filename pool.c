@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2019, 2020 Ali Farzanrad <ali_farzanrad@riseup.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#define _POSIX_C_SOURCE	200809L
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "conf.h"
+#include "msg.h"
+#include "pool.h"
+#include "uring.h"
+
+/*
+ * Every address of every connect setting is a backend of its service,
+ * and a stream only goes to those of the service it was accepted for:
+ * to the backend with the fewest streams, or with the lowest connect
+ * time weighted by its streams.  Connects are the health checks: a
+ * backend that fails one is left out for a while, doubled on every
+ * failure in a row, and the stream is tried on the next best one.
+ *
+ * Connects do not block: the socket of a stream is writable once its
+ * connect is done, or it is given up after ConnectTimeout, and only
+ * then is the backend timed or left out.  The tunnel goes on meanwhile.
+ * A connect is not handed to the next process, it is cancelled; the
+ * streams handed over find their backend again by its address.
+ */
+
+enum {
+	ConnectTimeout = 3, /* seconds a connect may take */
+	EjectShiftMax = 6,
+	EwmaWeight = 8 /* of the old average against a new sample */
+};
+
+struct backend {
+	const struct addrinfo *ai;
+	int		 service;
+	int		 failures; /* in a row */
+	long long	 ewma; /* connect time, nanoseconds */
+	long long	 until; /* left out until then */
+};
+
+int		 pool_pick(long long, int, const struct peer *);
+int		 pool_streams(int, const struct peer *);
+int		 pool_start(int, const struct peer *);
+void		 pool_fail(int);
+int		 pool_try(const struct backend *);
+long long	 pool_now(void);
+
+struct backend	*backends;
+int		 nbackends;
+int		*owner; /* backend of every stream slot */
+long long	*since; /* start of its connect, 0 once done */
+int		*tries; /* backends tried for the stream */
+int		*errors; /* of its last connect, 0 if none was tried */
+int		 rotor;
+
+int
+pool_init(void)
+{
+	const struct addrinfo *ai;
+	int		 i, k;
+
+	for (k = 0; k < ServiceMax; ++k)
+		for (ai = conf.connect[k]; ai != NULL; ai = ai->ai_next)
+			++nbackends;
+
+	if ((backends = calloc((size_t)nbackends, sizeof(*backends))) == NULL ||
+	    (owner = calloc((size_t)conf.peers, sizeof(*owner))) == NULL ||
+	    (since = calloc((size_t)conf.peers, sizeof(*since))) == NULL ||
+	    (tries = calloc((size_t)conf.peers, sizeof(*tries))) == NULL ||
+	    (errors = calloc((size_t)conf.peers, sizeof(*errors))) == NULL)
+		return -1;
+
+	for (i = k = 0; k < ServiceMax; ++k)
+		for (ai = conf.connect[k]; ai != NULL; ai = ai->ai_next) {
+			backends[i].service = k;
+			backends[i++].ai = ai;
+		}
+	for (i = 0; i < conf.peers; ++i)
+		owner[i] = -1;
+
+	return 0;
+}
+
+int
+pool_connect(const int i, const struct peer *const peers)
+{
+	tries[i] = 0;
+	errors[i] = 0;
+	return pool_start(i, peers);
+}
+
+int
+pool_error(const int i)
+{
+	return errors[i];
+}
+
+void
+pool_cancel(const int i, const struct peer *const peers)
+{
+	close(peers[i].s);
+	owner[i] = -1;
+	since[i] = 0;
+	errors[i] = ECANCELED;
+}
+
+void
+pool_adopt(const int i, const struct peer *const peers)
+{
+	struct sockaddr_storage addr;
+	socklen_t	 len = sizeof(addr);
+	int		 b;
+
+	owner[i] = -1;
+	if (getpeername(peers[i].s, (struct sockaddr *)&addr, &len) == -1)
+		return;
+
+	for (b = 0; b < nbackends; ++b)
+		if (backends[b].service == peers[i].service &&
+		    backends[b].ai->ai_addrlen == len &&
+		    memcmp(backends[b].ai->ai_addr, &addr, len) == 0) {
+			owner[i] = b;
+			return;
+		}
+}
+
+int
+pool_connecting(const int i)
+{
+	return since[i] != 0;
+}
+
+int
+pool_finish(const int i, const int ready, const struct peer *const peers)
+{
+	struct backend	*const be = &backends[owner[i]];
+	struct sockaddr_storage addr;
+	socklen_t	 len = sizeof(addr);
+	long long	 t = pool_now() - since[i];
+	int		 s = peers[i].s, error = 0;
+
+	/* writable is not enough for every select, the peer must be known */
+	if (ready && getpeername(s, (struct sockaddr *)&addr, &len) == 0) {
+		since[i] = 0;
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL) & ~O_NONBLOCK);
+		be->failures = 0;
+		be->ewma = be->ewma == 0 ? t :
+		    be->ewma + (t - be->ewma) / EwmaWeight;
+		return s;
+	}
+
+	len = sizeof(error);
+	if (ready && getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+		error = errno;
+	if (error == 0 && t < ConnectTimeout * 1000LL * 1000 * 1000)
+		return s;
+
+	close(s);
+	pool_fail(i);
+	errors[i] = error != 0 ? error : ETIMEDOUT;
+	return pool_start(i, peers);
+}
+
+int
+pool_start(const int i, const struct peer *const peers)
+{
+	int		 b, s;
+
+	for (; tries[i] < nbackends; ++tries[i]) {
+		if ((b = pool_pick(pool_now(), peers[i].service, peers)) == -1)
+			break;
+
+		owner[i] = b;
+		since[i] = pool_now();
+		if ((s = pool_try(&backends[b])) != -1) {
+			++tries[i];
+			return s;
+		}
+
+		errors[i] = errno;
+		pool_fail(i);
+	}
+
+	owner[i] = -1;
+	since[i] = 0;
+	return -1;
+}
+
+void
+pool_fail(const int i)
+{
+	struct backend	*const be = &backends[owner[i]];
+	const int	 shift = be->failures < EjectShiftMax ? be->failures :
+			    EjectShiftMax;
+
+	++be->failures;
+	be->until = pool_now() + ((long long)conf.eject << shift) *
+	    1000 * 1000 * 1000;
+	since[i] = 0;
+}
+
+int
+pool_pick(const long long now, const int service,
+    const struct peer *const peers)
+{
+	int		 i, best = -1, bstreams = 0;
+	long long	 bscore = 0;
+
+	/* start somewhere else every time, equal backends take turns */
+	rotor = (rotor + 1) % nbackends;
+
+	for (i = 0; i < nbackends; ++i) {
+		const int	 b = (rotor + i) % nbackends;
+		const struct backend *const be = &backends[b];
+		const int	 streams = pool_streams(b, peers);
+		long long	 score;
+
+		if (be->service != service || be->until > now)
+			continue;
+
+		score = conf.latency ? be->ewma * (streams + 1) : streams;
+		if (best == -1 || score < bscore ||
+		    (score == bscore && streams < bstreams)) {
+			best = b;
+			bscore = score;
+			bstreams = streams;
+		}
+	}
+
+	if (best != -1)
+		return best;
+
+	/* all are out, the one back soonest is still worth a try */
+	for (i = 0; i < nbackends; ++i)
+		if (backends[i].service == service && (best == -1 ||
+		    backends[i].until < backends[best].until))
+			best = i;
+
+	return best;
+}
+
+int
+pool_streams(const int b, const struct peer *const peers)
+{
+	int		 i, n = 0;
+
+	/* counted, not kept, a reset closes streams behind our back */
+	for (i = 0; i < session.peers; ++i)
+		if (owner[i] == b && peers[i].s != -1)
+			++n;
+
+	return n;
+}
+
+int
+pool_try(const struct backend *const be)
+{
+	const struct addrinfo *const ai = be->ai;
+	int		 s, error;
+
+	if ((s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+		return -1;
+
+	if (fcntl(s, F_SETFL, O_NONBLOCK) == -1 ||
+	    (connect(s, ai->ai_addr, ai->ai_addrlen) == -1 &&
+	    errno != EINPROGRESS)) {
+		error = errno;
+		close(s);
+		errno = error;
+		return -1;
+	}
+
+	return s;
+}
+
+long long
+pool_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL * 1000 * 1000 + ts.tv_nsec;
+}
@@ -0,0 +1,20 @@
+/* pool_init: collect the backends nstd connects streams to */
+int		 pool_init(void);
+
+/* pool_connect: start connecting stream i to the best backend */
+int		 pool_connect(int, const struct peer *);
+
+/* pool_connecting: the connect of stream i is not done yet */
+int		 pool_connecting(int);
+
+/* pool_error: the error of the last connect of stream i, 0 if none */
+int		 pool_error(int);
+
+/* pool_cancel: close stream i while it connects, to hand the rest over */
+void		 pool_cancel(int, const struct peer *);
+
+/* pool_adopt: find the backend of stream i, taken from the last process */
+void		 pool_adopt(int, const struct peer *);
+
+/* pool_finish: see if a connect is done or late, failing over if it failed */
+int		 pool_finish(int, int, const struct peer *);
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2019, 2020 Ali Farzanrad <ali_farzanrad@riseup.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#define _POSIX_C_SOURCE	200809L
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <limits.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "conf.h"
+#include "msg.h"
+#include "spill.h"
+
+/*
+ * A stream keeps up to its window in memory, what comes while it is
+ * full goes to a ring in a file mapped for it, and comes back as the
+ * consumer frees half of the window.  The file is unlinked at once and
+ * unmapped once drained, so nothing is left behind.
+ *
+ * The ring holds the spill setting past the largest window, and the
+ * credit we give is at most that much past what is not written yet.
+ */
+
+#define SPILL_SIZE	(conf.spill + conf.windowmax)
+
+uint8_t		*spill_map(void);
+void		 spill_copy(uint8_t *, const uint8_t *, size_t, size_t, int);
+
+int
+spill_push(struct peer *const peer, size_t n)
+{
+	if (conf.spill == 0)
+		return 1;
+	else if (peer->recv.spilled == 0 && peer->recv.size > peer->recv.window)
+		n = peer->recv.size - peer->recv.window;
+	else if (peer->recv.spilled == 0)
+		return 1;
+
+	if (peer->recv.spill == NULL &&
+	    (peer->recv.spill = spill_map()) == NULL)
+		return 0;
+	else if (n > SPILL_SIZE - peer->recv.spilled)
+		return 0;
+
+	peer->recv.size -= n;
+	spill_copy(peer->recv.spill, peer->recv.buf + peer->recv.off +
+	    peer->recv.size, n, (peer->recv.spilloff + peer->recv.spilled) %
+	    SPILL_SIZE, 1);
+	peer->recv.spilled += n;
+	return 1;
+}
+
+void
+spill_pull(struct peer *const peer)
+{
+	size_t		 n = peer->recv.window - peer->recv.size;
+
+	/* in halves of the window, not a little on every write */
+	if (peer->recv.spilled == 0 || peer->recv.size > peer->recv.window >> 1)
+		return;
+
+	if (n > peer->recv.spilled)
+		n = peer->recv.spilled;
+	if (!msg_reserve(peer, n))
+		return;
+
+	spill_copy(peer->recv.buf + peer->recv.off + peer->recv.size,
+	    peer->recv.spill, n, peer->recv.spilloff, 0);
+	peer->recv.size += n;
+	peer->recv.spilloff = (peer->recv.spilloff + n) % SPILL_SIZE;
+	if ((peer->recv.spilled -= n) == 0)
+		spill_drop(peer);
+}
+
+void
+spill_save(FILE *const fp, const struct peer *const peer)
+{
+	const size_t	 off = peer->recv.spilloff;
+	const size_t	 size = peer->recv.spilled;
+	const size_t	 first = SPILL_SIZE - off < size ? SPILL_SIZE - off :
+			    size;
+
+	if (size > 0) {
+		fwrite(peer->recv.spill + off, 1, first, fp);
+		fwrite(peer->recv.spill, 1, size - first, fp);
+	}
+}
+
+int
+spill_load(FILE *const fp, struct peer *const peer, const size_t size)
+{
+	spill_drop(peer);
+	if (size == 0)
+		return 1;
+	else if (conf.spill == 0 || size > SPILL_SIZE ||
+	    (peer->recv.spill = spill_map()) == NULL)
+		return 0;
+
+	peer->recv.spilled = size;
+	return fread(peer->recv.spill, 1, size, fp) == size;
+}
+
+void
+spill_drop(struct peer *const peer)
+{
+	if (peer->recv.spill != NULL)
+		munmap(peer->recv.spill, SPILL_SIZE);
+
+	peer->recv.spill = NULL;
+	peer->recv.spilloff = 0;
+	peer->recv.spilled = 0;
+}
+
+uint8_t *
+spill_map(void)
+{
+	char		 path[PATH_MAX];
+	void		*p;
+	int		 fd;
+
+	if (snprintf(path, sizeof(path), "%s/nst.XXXXXXXXXX",
+	    conf.spilldir) >= (int)sizeof(path) || (fd = mkstemp(path)) == -1)
+		return NULL;
+
+	/* the mapping keeps the file, nobody else should see it */
+	unlink(path);
+	if (ftruncate(fd, (off_t)SPILL_SIZE) == -1)
+		p = MAP_FAILED;
+	else
+		p = mmap(NULL, SPILL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+
+	close(fd);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+void
+spill_copy(uint8_t *const dst, const uint8_t *const src, const size_t size,
+    const size_t off, const int in)
+{
+	const size_t	 first = SPILL_SIZE - off < size ? SPILL_SIZE - off :
+			    size;
+
+	/* the ring wraps at most once */
+	if (in) {
+		memcpy(dst + off, src, first);
+		memcpy(dst, src + first, size - first);
+	} else {
+		memcpy(dst, src + off, first);
+		memcpy(dst + first, src, size - first);
+	}
+}
@@ -0,0 +1,14 @@
+/* spill_push: after n bytes came, move what is past the window to the file */
+int		 spill_push(struct peer *, size_t);
+
+/* spill_pull: bring spilled data back as the consumer catches up */
+void		 spill_pull(struct peer *);
+
+/* spill_save: write what a stream has spilled, oldest first */
+void		 spill_save(FILE *, const struct peer *);
+
+/* spill_load: read size bytes spilled by the previous process */
+int		 spill_load(FILE *, struct peer *, size_t);
+
+/* spill_drop: forget spilled data and let the file go */
+void		 spill_drop(struct peer *);
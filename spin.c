@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2019, 2020 Ali Farzanrad <ali_farzanrad@riseup.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#define _GNU_SOURCE
+
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <netdb.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "conf.h"
+#include "msg.h"
+#include "tune.h"
+#include "spin.h"
+
+#ifdef USE_IO_URING
+#error "USE_BUSY_POLL does not work with USE_IO_URING"
+#endif
+
+/*
+ * With busypoll set, the tunnel runs on one cpu and does not sleep: the
+ * sockets are polled without waiting until one is ready or the timeout
+ * of the next message passes, and the kernel spins on the udp socket
+ * for a little while on every read.  After SpinIdle without anything to
+ * do, select sleeps again until the next datagram, so an idle tunnel
+ * gives the cpu back.  Workers of USE_THREADS are not pinned.
+ */
+
+#define SECOND		(1000LL * 1000 * 1000)
+
+enum {
+	BusyPollUsec = 50, /* the kernel spins this long on a read */
+	SpinIdle = 100 /* milliseconds of nothing before select sleeps */
+};
+
+long long	 active; /* when something was last ready */
+
+int
+spin_init(const int s)
+{
+	const int	 usec = BusyPollUsec;
+	cpu_set_t	 cpus;
+
+	if (conf.busypoll == -1)
+		return 0;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(conf.busypoll, &cpus);
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+		return -1;
+
+#ifdef SO_BUSY_POLL
+	/* above net.core.busy_read this needs CAP_NET_ADMIN, we spin anyway */
+	setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+#else
+	(void)s;
+	(void)usec;
+#endif
+	active = tune_now();
+	return 0;
+}
+
+int
+spin_select(const int nfds, fd_set *const r, fd_set *const w,
+    fd_set *const e, struct timeval *const timeout)
+{
+	const long long	 start = tune_now();
+	const long long	 wait = timeout == NULL ? -1 : timeout->tv_sec *
+			    SECOND + timeout->tv_usec * 1000LL;
+	struct timeval	 zero;
+	fd_set		 rfds, wfds, efds;
+	int		 n;
+
+	if (conf.busypoll == -1)
+		return select(nfds, r, w, e, timeout);
+	else if (start - active > SpinIdle * (SECOND / 1000)) {
+		if ((n = select(nfds, r, w, e, timeout)) > 0)
+			active = tune_now();
+		return n;
+	}
+
+	/* select clears what is not ready, the sets are kept for the next try */
+	if (r != NULL)
+		rfds = *r;
+	if (w != NULL)
+		wfds = *w;
+	if (e != NULL)
+		efds = *e;
+
+	for (;;) {
+		memset(&zero, 0, sizeof(zero));
+		if ((n = select(nfds, r, w, e, &zero)) != 0) {
+			if (n > 0)
+				active = tune_now();
+			return n;
+		} else if (wait != -1 && tune_now() - start >= wait)
+			return 0;
+
+		if (r != NULL)
+			*r = rfds;
+		if (w != NULL)
+			*w = wfds;
+		if (e != NULL)
+			*e = efds;
+	}
+}
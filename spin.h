@@ -0,0 +1,8 @@
+#ifdef USE_BUSY_POLL
+/* spin_init: pin to the busypoll cpu and have the kernel spin on reads */
+int		 spin_init(int);
+
+/* spin_select: select(2), but polls without sleeping while busy */
+int		 spin_select(int, fd_set *, fd_set *, fd_set *,
+		    struct timeval *);
+#endif
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2019, 2020 Ali Farzanrad <ali_farzanrad@riseup.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#define _POSIX_C_SOURCE	200809L
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "conf.h"
+#include "msg.h"
+#include "tune.h"
+
+/*
+ * The udp socket holds twice what is in flight for a round trip at the
+ * rate we see, in the busier direction, and never less than the kernel
+ * gave it.  If the kernel still drops datagrams, that least size is
+ * doubled.  A new stream is interactive: no Nagle, and little unsent
+ * data in the kernel, so credit follows what the consumer really took.
+ * Once its window grows past the initial one, it is bulk and its buffers
+ * grow to the window and the path.  They never shrink below what the
+ * kernel chose, a receive buffer under a segment stalls the stream.
+ */
+
+#define SECOND		(1000LL * 1000 * 1000)
+
+void		 tune_buffers(int, size_t, size_t);
+void		 tune_grow(int, int, size_t);
+
+long long	 srtt; /* 0 until sampled */
+long long	 period; /* start of the current second */
+size_t		 counted[2];
+size_t		 bdp;
+size_t		 least, applied; /* of the udp socket */
+uint32_t	 drops, seen;
+
+void
+tune_udp(const int s)
+{
+	const long long	 now = tune_now();
+	socklen_t	 len = sizeof(int);
+	size_t		 rate, target;
+	int		 on = 1, size;
+
+	if (conf.sockbuf == 0)
+		return;
+	else if (least == 0) {
+#ifdef SO_RXQ_OVFL
+		setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+#else
+		(void)on;
+#endif
+		if (getsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, &len) == -1)
+			size = 1 << 16;
+		least = applied = (size_t)size;
+		period = now;
+		return;
+	} else if (now - period < SECOND)
+		return;
+
+	rate = counted[TuneIn] > counted[TuneOut] ? counted[TuneIn] :
+	    counted[TuneOut];
+	rate = (size_t)(rate * SECOND / (now - period));
+	counted[TuneIn] = counted[TuneOut] = 0;
+	period = now;
+	bdp = (size_t)(rate * srtt / SECOND);
+
+	/* the estimate was not enough */
+	if (drops != seen) {
+		seen = drops;
+		least = applied << 1;
+	}
+
+	target = 2 * bdp > least ? 2 * bdp : least;
+	if (target > conf.sockbuf)
+		target = conf.sockbuf;
+	if (least > conf.sockbuf)
+		least = conf.sockbuf;
+
+	/* a quarter either way is not worth a system call */
+	if (target > applied + (applied >> 2) ||
+	    target < applied - (applied >> 2)) {
+		tune_buffers(s, target, target);
+		applied = target;
+	}
+}
+
+void
+tune_open(const int s)
+{
+	int		 on = 1;
+
+	if (conf.sockbuf == 0)
+		return;
+
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#ifdef TCP_NOTSENT_LOWAT
+	on = (int)session.peermaxsend;
+	setsockopt(s, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &on, sizeof(on));
+#endif
+}
+
+void
+tune_stream(struct peer *const peer)
+{
+	const size_t	 window = peer->recv.window;
+	int		 lowat;
+
+	if (conf.sockbuf == 0 || peer->s == -1 || window == peer->sockbuf ||
+	    window <= session.windowinit)
+		return;
+
+	/* what we write waits for the consumer, what we read for credit */
+	tune_grow(peer->s, SO_SNDBUF, window < conf.sockbuf ? window :
+	    conf.sockbuf);
+	tune_grow(peer->s, SO_RCVBUF, bdp < conf.sockbuf ? bdp : conf.sockbuf);
+#ifdef TCP_NOTSENT_LOWAT
+	lowat = (int)(window >> 1);
+	setsockopt(peer->s, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+	    sizeof(lowat));
+#else
+	(void)lowat;
+#endif
+	peer->sockbuf = window;
+}
+
+void
+tune_rtt(const long long sample)
+{
+	srtt = srtt == 0 ? sample : srtt + (sample - srtt) / 8;
+}
+
+void
+tune_count(const int way, const size_t n)
+{
+	counted[way] += n;
+}
+
+void
+tune_drops(const uint32_t n)
+{
+	drops = n;
+}
+
+long long
+tune_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * SECOND + ts.tv_nsec;
+}
+
+void
+tune_buffers(const int s, const size_t snd, const size_t rcv)
+{
+	const int	 sndsize = (int)snd, rcvsize = (int)rcv;
+
+	setsockopt(s, SOL_SOCKET, SO_SNDBUF, &sndsize, sizeof(sndsize));
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvsize, sizeof(rcvsize));
+}
+
+void
+tune_grow(const int s, const int opt, const size_t size)
+{
+	socklen_t	 len = sizeof(int);
+	int		 cur;
+
+	if (getsockopt(s, SOL_SOCKET, opt, &cur, &len) == 0 &&
+	    (size_t)cur < size) {
+		cur = (int)size;
+		setsockopt(s, SOL_SOCKET, opt, &cur, sizeof(cur));
+	}
+}
@@ -0,0 +1,25 @@
+/* tune_udp: resize the buffers of the udp socket once a second */
+void		 tune_udp(int);
+
+/* tune_open: make a new stream socket interactive */
+void		 tune_open(int);
+
+/* tune_stream: size the buffers of a bulk stream to its window */
+void		 tune_stream(struct peer *);
+
+/* tune_rtt: take a round trip sample, in nanoseconds */
+void		 tune_rtt(long long);
+
+/* tune_count: count bytes which came, or went and were acked */
+void		 tune_count(int, size_t);
+
+/* tune_drops: the kernel has dropped this many datagrams so far */
+void		 tune_drops(uint32_t);
+
+/* tune_now: monotonic nanoseconds */
+long long	 tune_now(void);
+
+enum {
+	TuneIn = 0,
+	TuneOut = 1
+};
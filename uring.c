@@ -0,0 +1,628 @@
+/*
+ * Copyright (c) 2019, 2020 Ali Farzanrad <ali_farzanrad@riseup.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <linux/io_uring.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "conf.h"
+#include "msg.h"
+#include "uring.h"
+
+#define USER_DATA(op, fd)	((uint64_t)(op) << 32 | (uint32_t)(fd))
+#define STAGE(dir, fd)		(stage + ((size_t)(dir) * (size_t)conf.openmax + \
+				    (size_t)(fd)) * conf.peermaxsend)
+#define DGRAM(bid)		(dgram + (size_t)(bid) * (conf.datagram + 1))
+
+enum {
+	RingSize = 64,
+	DgramCount = 16, /* power of 2 */
+	DgramGroup = 0
+};
+
+enum Op {
+	OpRecv = 1,
+	OpAccept,
+	OpRead,
+	OpWrite,
+	OpPoll,
+	OpCancel
+};
+
+enum Kind {
+	KindUnknown = 0,
+	KindDgram,
+	KindListen,
+	KindStream
+};
+
+struct fdstate {
+	char		 kind;
+	char		 closing;
+	char		 rbusy;
+	char		 wbusy;
+	char		 connecting; /* polled until it is writable */
+	char		 rdone;
+	int		 rres;
+	int		 werr;
+	size_t		 roff;
+	size_t		 woff;
+	size_t		 wlen;
+	int		 qhead;
+	int		 qcount;
+	int		 q[DgramCount]; /* buffer ids or accepted sockets */
+	size_t		 qlen[DgramCount];
+};
+
+struct io_uring_sqe *uring_sqe(void);
+void		 uring_enter(int, const struct timeval *);
+void		 uring_reap(void);
+void		 uring_complete(enum Op, int, int, unsigned);
+int		 uring_ready(int, const fd_set *, const fd_set *,
+		    fd_set *, fd_set *);
+void		 uring_kind(int);
+void		 uring_arm(int);
+void		 uring_write(int);
+void		 uring_cancel(int, enum Op);
+void		 uring_putbuf(int);
+void		 uring_finish(int);
+
+int		 ring_fd = -1;
+unsigned	 enter_flags;
+unsigned	*sq_head, *sq_tail, sq_mask, sq_entries, sq_local;
+unsigned	*cq_head, *cq_tail, cq_mask;
+struct io_uring_sqe *sqes;
+struct io_uring_cqe *cqes;
+struct io_uring_buf *dbufs;
+uint16_t	 dtail;
+struct fdstate	*fds;
+
+/* registered frame pool: read and write staging per socket */
+uint8_t		*stage;
+uint8_t		*dgram;
+
+int
+uring_init(void)
+{
+	struct io_uring_params	 p;
+	struct io_uring_buf_reg	 reg;
+	struct io_uring_rsrc_update up;
+	struct iovec	 iov;
+	uint8_t		*sq, *cq;
+	unsigned	 i;
+	const size_t	 stagesize = 2 * (size_t)conf.openmax * conf.peermaxsend;
+
+	/* datagrams one byte longer than ours are dropped */
+	if ((fds = calloc((size_t)conf.openmax, sizeof(*fds))) == NULL ||
+	    (dgram = malloc(DgramCount * (conf.datagram + 1))) == NULL)
+		return -1;
+
+	memset(&p, 0, sizeof(p));
+	if ((ring_fd = (int)syscall(__NR_io_uring_setup, RingSize, &p)) == -1)
+		return -1;
+	else if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	sq = mmap(NULL, p.sq_off.array + p.sq_entries * sizeof(unsigned),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+	    IORING_OFF_SQ_RING);
+	cq = mmap(NULL, p.cq_off.cqes + p.cq_entries *
+	    sizeof(struct io_uring_cqe), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+	    IORING_OFF_SQES);
+	dbufs = mmap(NULL, DgramCount * sizeof(struct io_uring_buf),
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	stage = mmap(NULL, stagesize, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED ||
+	    dbufs == MAP_FAILED || stage == MAP_FAILED)
+		return -1;
+
+	sq_head = (unsigned *)(sq + p.sq_off.head);
+	sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	sq_entries = p.sq_entries;
+	sq_local = *sq_tail;
+	for (i = 0; i < p.sq_entries; ++i)
+		((unsigned *)(sq + p.sq_off.array))[i] = i;
+
+	cq_head = (unsigned *)(cq + p.cq_off.head);
+	cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	iov.iov_base = stage;
+	iov.iov_len = stagesize;
+	if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS,
+	    &iov, 1) == -1)
+		return -1;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)dbufs;
+	reg.ring_entries = DgramCount;
+	reg.bgid = DgramGroup;
+	if (syscall(__NR_io_uring_register, ring_fd,
+	    IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		return -1;
+
+	for (i = 0; i < DgramCount; ++i)
+		uring_putbuf((int)i);
+
+	/* the ring does not need a file descriptor once registered */
+	memset(&up, 0, sizeof(up));
+	up.offset = -1U;
+	up.data = (uint64_t)ring_fd;
+	if (syscall(__NR_io_uring_register, ring_fd,
+	    IORING_REGISTER_RING_FDS, &up, 1) == 1) {
+		(close)(ring_fd);
+		ring_fd = (int)up.offset;
+		enter_flags = IORING_ENTER_REGISTERED_RING;
+	}
+
+	return 0;
+}
+
+int
+uring_select(const int nfds, fd_set *const r, fd_set *const w,
+    fd_set *const e, struct timeval *const timeout)
+{
+	fd_set		 rin, win;
+	int		 fd, n;
+
+	(void)e;
+	FD_ZERO(&rin);
+	FD_ZERO(&win);
+	if (r != NULL)
+		rin = *r;
+	if (w != NULL)
+		win = *w;
+
+	for (fd = 0; fd < nfds && fd < conf.openmax; ++fd) {
+		if (FD_ISSET(fd, &rin) || FD_ISSET(fd, &win))
+			uring_kind(fd);
+		if (FD_ISSET(fd, &rin))
+			uring_arm(fd);
+	}
+
+	uring_reap();
+	if ((n = uring_ready(nfds, &rin, &win, r, w)) > 0) {
+		if (sq_local != __atomic_load_n(sq_head, __ATOMIC_ACQUIRE))
+			uring_enter(0, NULL);
+		return n;
+	}
+
+	/* one system call submits everything and waits */
+	uring_enter(1, timeout);
+	uring_reap();
+	return uring_ready(nfds, &rin, &win, r, w);
+}
+
+ssize_t
+uring_recv(const int s, void *const buf, const size_t len, const int flags)
+{
+	struct fdstate	*f;
+	size_t		 n;
+
+	if (s < 0 || s >= conf.openmax || fds[s].kind == KindUnknown)
+		return (recv)(s, buf, len, flags);
+
+	f = &fds[s];
+	if (f->kind == KindDgram) {
+		int		 bid;
+
+		if (f->qcount == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		bid = f->q[f->qhead];
+		n = len < f->qlen[f->qhead] ? len : f->qlen[f->qhead];
+		memcpy(buf, DGRAM(bid), n);
+		uring_putbuf(bid);
+		f->qhead = (f->qhead + 1) % DgramCount;
+		--f->qcount;
+		return (ssize_t)n;
+	} else if (!f->rdone) {
+		errno = EAGAIN;
+		return -1;
+	} else if (f->rres < 0) {
+		errno = -f->rres;
+		f->rdone = 0;
+		return -1;
+	}
+
+	n = (size_t)f->rres - f->roff;
+	n = len < n ? len : n;
+	memcpy(buf, STAGE(0, s) + f->roff, n);
+	if ((f->roff += n) == (size_t)f->rres)
+		f->rdone = 0;
+
+	return (ssize_t)n;
+}
+
+ssize_t
+uring_send(const int s, const void *const buf, const size_t len,
+    const int flags)
+{
+	struct fdstate	*f;
+	size_t		 n;
+
+	if (s < 0 || s >= conf.openmax || fds[s].kind != KindStream)
+		return (send)(s, buf, len, flags);
+
+	f = &fds[s];
+	if (f->werr != 0) {
+		errno = -f->werr;
+		f->werr = 0;
+		return -1;
+	} else if (f->wbusy || f->closing) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	n = len < conf.peermaxsend ? len : conf.peermaxsend;
+	memcpy(STAGE(1, s), buf, n);
+	f->woff = 0;
+	f->wlen = n;
+	uring_write(s);
+	return (ssize_t)n;
+}
+
+int
+uring_accept(const int s, struct sockaddr *const addr,
+    socklen_t *const addrlen)
+{
+	struct fdstate	*f;
+	int		 fd;
+
+	if (s < 0 || s >= conf.openmax || fds[s].kind != KindListen)
+		return (accept)(s, addr, addrlen);
+
+	f = &fds[s];
+	if (f->qcount == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	fd = f->q[f->qhead];
+	f->qhead = (f->qhead + 1) % DgramCount;
+	--f->qcount;
+	return fd;
+}
+
+int
+uring_connect(const int s, const struct sockaddr *const addr,
+    const socklen_t addrlen)
+{
+	struct io_uring_sqe *sqe;
+	int		 ret;
+
+	if ((ret = (connect)(s, addr, addrlen)) == 0 || errno != EINPROGRESS ||
+	    fds == NULL || s >= conf.openmax)
+		return ret;
+
+	/* writable only once connected, not as soon as it is asked */
+	uring_kind(s);
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = s;
+	sqe->poll32_events = POLLOUT;
+	sqe->user_data = USER_DATA(OpPoll, s);
+	fds[s].connecting = 1;
+	errno = EINPROGRESS;
+	return -1;
+}
+
+int
+uring_close(const int fd)
+{
+	struct fdstate	*f;
+
+	if (fds == NULL || fd < 0 || fd >= conf.openmax ||
+	    fds[fd].kind == KindUnknown)
+		return (close)(fd);
+
+	f = &fds[fd];
+	f->closing = 1;
+	f->rdone = 0;
+
+	if (f->rbusy)
+		uring_cancel(fd, f->kind == KindDgram ? OpRecv :
+		    f->kind == KindListen ? OpAccept : OpRead);
+	if (f->connecting)
+		uring_cancel(fd, OpPoll);
+
+	for (; f->qcount > 0; --f->qcount) {
+		if (f->kind == KindDgram)
+			uring_putbuf(f->q[f->qhead]);
+		else
+			(close)(f->q[f->qhead]);
+		f->qhead = (f->qhead + 1) % DgramCount;
+	}
+
+	/* queued writes still go out, like close(2) on a blocking socket */
+	if (!f->rbusy && !f->wbusy && !f->connecting)
+		uring_finish(fd);
+
+	return 0;
+}
+
+struct io_uring_sqe *
+uring_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	if (sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) ==
+	    sq_entries)
+		uring_enter(0, NULL);
+
+	sqe = &sqes[sq_local++ & sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+void
+uring_enter(const int wait, const struct timeval *const timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned	 flags = enter_flags | IORING_ENTER_EXT_ARG;
+	unsigned	 n;
+
+	__atomic_store_n(sq_tail, sq_local, __ATOMIC_RELEASE);
+	n = sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+	memset(&arg, 0, sizeof(arg));
+	if (wait) {
+		flags |= IORING_ENTER_GETEVENTS;
+		if (timeout != NULL) {
+			ts.tv_sec = timeout->tv_sec;
+			ts.tv_nsec = (long long)timeout->tv_usec * 1000;
+			arg.ts = (uintptr_t)&ts;
+		}
+	}
+
+	syscall(__NR_io_uring_enter, ring_fd, n, wait ? 1 : 0, flags,
+	    &arg, sizeof(arg));
+}
+
+void
+uring_reap(void)
+{
+	unsigned	 head = *cq_head;
+
+	for (; head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); ++head) {
+		const struct io_uring_cqe *const cqe = &cqes[head & cq_mask];
+
+		uring_complete((enum Op)(cqe->user_data >> 32),
+		    (int)(uint32_t)cqe->user_data, cqe->res, cqe->flags);
+		__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+	}
+}
+
+void
+uring_complete(const enum Op op, const int fd, const int res,
+    const unsigned flags)
+{
+	struct fdstate	*const f = &fds[fd];
+	const int	 more = (flags & IORING_CQE_F_MORE) != 0;
+	int		 i;
+
+	switch (op) {
+	case OpRecv:
+	case OpAccept:
+		i = (f->qhead + f->qcount) % DgramCount;
+
+		if (op == OpRecv && res >= 0 && (flags & IORING_CQE_F_BUFFER)) {
+			f->q[i] = (int)(flags >> IORING_CQE_BUFFER_SHIFT);
+			f->qlen[i] = (size_t)res;
+			if (f->closing || f->qcount == DgramCount)
+				uring_putbuf(f->q[i]);
+			else
+				++f->qcount;
+		} else if (op == OpAccept && res >= 0) {
+			f->q[i] = res;
+			if (f->closing || f->qcount == DgramCount)
+				(close)(res);
+			else
+				++f->qcount;
+		}
+
+		if (!more)
+			f->rbusy = 0;
+		break;
+	case OpRead:
+		f->rbusy = 0;
+		if (!f->closing) {
+			f->rdone = 1;
+			f->rres = res;
+			f->roff = 0;
+		}
+		break;
+	case OpWrite:
+		if (res > 0 && (f->woff += (size_t)res) < f->wlen) {
+			uring_write(fd);
+			return;
+		} else if (res < 0)
+			f->werr = res;
+
+		f->wbusy = 0;
+		break;
+	case OpPoll:
+		/* connected or failed, pool_finish tells which */
+		f->connecting = 0;
+		break;
+	default:
+		return;
+	}
+
+	if (f->closing && !f->rbusy && !f->wbusy && !f->connecting)
+		uring_finish(fd);
+}
+
+int
+uring_ready(const int nfds, const fd_set *const rin, const fd_set *const win,
+    fd_set *const r, fd_set *const w)
+{
+	int		 fd, n = 0;
+
+	if (r != NULL)
+		FD_ZERO(r);
+	if (w != NULL)
+		FD_ZERO(w);
+
+	for (fd = 0; fd < nfds && fd < conf.openmax; ++fd) {
+		const struct fdstate *const f = &fds[fd];
+
+		if (FD_ISSET(fd, rin) && (f->rdone || f->qcount > 0)) {
+			FD_SET(fd, r);
+			++n;
+		}
+
+		if (FD_ISSET(fd, win) && !f->connecting &&
+		    (!f->wbusy || f->werr != 0)) {
+			FD_SET(fd, w);
+			++n;
+		}
+	}
+
+	return n;
+}
+
+void
+uring_kind(const int fd)
+{
+	int		 type = 0, listening = 0;
+	socklen_t	 len = sizeof(type);
+
+	if (fds[fd].kind != KindUnknown)
+		return;
+
+	getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len);
+	len = sizeof(listening);
+	getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len);
+
+	if (type == SOCK_DGRAM)
+		fds[fd].kind = KindDgram;
+	else if (listening)
+		fds[fd].kind = KindListen;
+	else
+		fds[fd].kind = KindStream;
+}
+
+void
+uring_arm(const int fd)
+{
+	struct fdstate	*const f = &fds[fd];
+	struct io_uring_sqe *sqe;
+
+	if (f->rbusy || f->rdone || f->closing)
+		return;
+
+	sqe = uring_sqe();
+	sqe->fd = fd;
+
+	switch (f->kind) {
+	case KindDgram:
+		/* one request keeps receiving into the buffer ring */
+		sqe->opcode = IORING_OP_RECV;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = DgramGroup;
+		sqe->user_data = USER_DATA(OpRecv, fd);
+		break;
+	case KindListen:
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->user_data = USER_DATA(OpAccept, fd);
+		break;
+	default:
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->addr = (uintptr_t)STAGE(0, fd);
+		sqe->len = (uint32_t)conf.peermaxsend;
+		sqe->buf_index = 0;
+		sqe->user_data = USER_DATA(OpRead, fd);
+		break;
+	}
+
+	f->rbusy = 1;
+}
+
+void
+uring_write(const int fd)
+{
+	struct fdstate	*const f = &fds[fd];
+	struct io_uring_sqe *const sqe = uring_sqe();
+
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)(STAGE(1, fd) + f->woff);
+	sqe->len = (uint32_t)(f->wlen - f->woff);
+	sqe->buf_index = 0;
+	sqe->user_data = USER_DATA(OpWrite, fd);
+	f->wbusy = 1;
+}
+
+void
+uring_cancel(const int fd, const enum Op op)
+{
+	struct io_uring_sqe *const sqe = uring_sqe();
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = USER_DATA(op, fd);
+	sqe->user_data = USER_DATA(OpCancel, fd);
+}
+
+void
+uring_putbuf(const int bid)
+{
+	struct io_uring_buf *const b = &dbufs[dtail & (DgramCount - 1)];
+
+	b->addr = (uintptr_t)DGRAM(bid);
+	b->len = (uint32_t)conf.datagram + 1;
+	b->bid = (uint16_t)bid;
+
+	/* the ring tail overlays resv of the first entry */
+	__atomic_store_n(&dbufs[0].resv, ++dtail, __ATOMIC_RELEASE);
+}
+
+void
+uring_finish(const int fd)
+{
+	(close)(fd);
+	memset(&fds[fd], 0, sizeof(fds[fd]));
+}
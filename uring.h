@@ -0,0 +1,29 @@
+#ifdef USE_IO_URING
+/* uring_init: set up the ring, every socket call below goes through it */
+int		 uring_init(void);
+
+/* uring_select: select(2), but arms reads and waits for completions */
+int		 uring_select(int, fd_set *, fd_set *, fd_set *,
+		    struct timeval *);
+
+/* uring_recv: take a completed read or a received datagram */
+ssize_t		 uring_recv(int, void *, size_t, int);
+
+/* uring_send: queue a write, it is submitted by the next uring_select */
+ssize_t		 uring_send(int, const void *, size_t, int);
+
+/* uring_accept: take an accepted connection, the address is not set */
+int		 uring_accept(int, struct sockaddr *, socklen_t *);
+
+/* uring_connect: connect(2), one in progress is writable once it is done */
+int		 uring_connect(int, const struct sockaddr *, socklen_t);
+
+/* uring_close: cancel reads and close once queued writes are done */
+int		 uring_close(int);
+
+#define recv(s,b,l,f)	uring_recv(s, b, l, f)
+#define send(s,b,l,f)	uring_send(s, b, l, f)
+#define accept(s,a,l)	uring_accept(s, a, l)
+#define connect(s,a,l)	uring_connect(s, a, l)
+#define close(s)	uring_close(s)
+#endif
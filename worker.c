@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2019, 2020 Ali Farzanrad <ali_farzanrad@riseup.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#define _POSIX_C_SOURCE	200809L
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "conf.h"
+#include "msg.h"
+#include "worker.h"
+
+#ifdef USE_IO_URING
+#error "USE_THREADS does not work with USE_IO_URING"
+#endif
+
+/*
+ * Every worker has a single producer, single consumer ring: the io
+ * thread queues jobs at tail, the worker finishes them up to done, and
+ * the io thread collects them from head.  Jobs go to the workers round
+ * robin, so collecting them round robin keeps the original order.
+ */
+
+enum {
+	WorkerCount = 2,
+	WorkerSlots = 8, /* power of 2 */
+	BurstMax = WorkerCount * WorkerSlots / 2
+};
+
+enum Job {
+	JobSeal = 1,
+	JobOpen
+};
+
+struct job {
+	enum Job	 type;
+	int		 s;
+	int		 ok;
+	int		 ce;
+	int		 timed;
+	uint32_t	 ticket;
+	size_t		 size;
+	struct addrinfo	 to; /* a copy, the path may move meanwhile */
+	struct sockaddr_storage toaddr;
+	struct timespec	 when;
+	struct sockaddr_storage from;
+	uint8_t		*buf; /* DatagramMaxSize + 16 */
+};
+
+struct worker {
+	pthread_t	 thread;
+	sem_t		 wake;
+	unsigned	 head;
+	unsigned	 done;
+	unsigned	 tail;
+	struct job	 jobs[WorkerSlots];
+};
+
+void		*worker_main(void *);
+struct job	*worker_job(void);
+void		 worker_push(void);
+struct job	*worker_peek(int);
+void		 worker_drop(void);
+
+struct worker	 workers[WorkerCount];
+unsigned	 dispatched, collected;
+uint32_t	 tickets, sent;
+int		 returned;
+
+int
+worker_start(void)
+{
+	int		 i, j, error;
+
+	for (i = 0; i < WorkerCount; ++i) {
+		for (j = 0; j < WorkerSlots; ++j)
+			if ((workers[i].jobs[j].buf =
+			    malloc(conf.datagram + 16)) == NULL)
+				return -1;
+
+		if (sem_init(&workers[i].wake, 0, 0) == -1)
+			return -1;
+
+		error = pthread_create(&workers[i].thread, NULL, worker_main,
+		    &workers[i]);
+		if (error != 0) {
+			errno = error;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void
+worker_send(const int s, const uint8_t *const buf, const size_t size,
+    const struct addrinfo *const to, const struct timespec *const when)
+{
+	struct job	*job;
+
+	while ((job = worker_job()) == NULL)
+		sched_yield();
+
+	job->type = JobSeal;
+	job->s = s;
+	job->ticket = tickets++;
+	job->size = size;
+	job->to = *to;
+	job->to.ai_addr = (struct sockaddr *)&job->toaddr;
+	memcpy(&job->toaddr, to->ai_addr, to->ai_addrlen);
+	if ((job->timed = when != NULL))
+		job->when = *when;
+	memcpy(job->buf, buf, size);
+	worker_push();
+}
+
+void
+worker_recv(const int s)
+{
+	struct job	*job;
+	ssize_t		 nr;
+	int		 i, flags = 0;
+
+	for (i = 0; i < BurstMax && (job = worker_job()) != NULL; ++i) {
+		nr = msg_recvce(s, job->buf, conf.datagram + 1, flags, &job->ce,
+		    &job->from);
+		if (nr == -1)
+			break;
+
+		/* only the first one is known to be there */
+		flags = MSG_DONTWAIT;
+		job->type = JobOpen;
+		job->size = (size_t)nr;
+		worker_push();
+	}
+}
+
+const uint8_t *
+worker_next(size_t *const size, int *const ce,
+    struct sockaddr_storage *const from)
+{
+	struct job	*job;
+
+	if (returned) {
+		worker_drop();
+		returned = 0;
+	}
+
+	while ((job = worker_peek(1)) != NULL) {
+		if (job->type == JobOpen && job->ok) {
+			*size = job->size;
+			*ce = job->ce;
+			*from = job->from;
+			returned = 1;
+			return job->buf;
+		}
+
+		worker_drop();
+	}
+
+	return NULL;
+}
+
+void *
+worker_main(void *const arg)
+{
+	struct worker	*const w = arg;
+
+	for (;;) {
+		struct job	*job;
+
+		while (__atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) == w->done)
+			sem_wait(&w->wake);
+
+		job = &w->jobs[w->done & (WorkerSlots - 1)];
+		if (job->type == JobOpen)
+			job->ok = msg_open(job->buf, job->size);
+		else {
+			msg_seal(job->buf, job->size);
+			while (__atomic_load_n(&sent, __ATOMIC_ACQUIRE) !=
+			    job->ticket)
+				sched_yield();
+			msg_sendto(job->s, job->buf, job->size, &job->to,
+			    job->timed ? &job->when : NULL);
+			__atomic_store_n(&sent, job->ticket + 1,
+			    __ATOMIC_RELEASE);
+		}
+
+		__atomic_store_n(&w->done, w->done + 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+struct job *
+worker_job(void)
+{
+	struct worker	*const w = &workers[dispatched % WorkerCount];
+	struct job	*job;
+
+	/* sealed datagrams are gone already, just take their slots back */
+	while ((job = worker_peek(0)) != NULL && job->type == JobSeal)
+		worker_drop();
+
+	if (w->tail - w->head == WorkerSlots)
+		return NULL;
+
+	return &w->jobs[w->tail & (WorkerSlots - 1)];
+}
+
+void
+worker_push(void)
+{
+	struct worker	*const w = &workers[dispatched++ % WorkerCount];
+
+	__atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
+	sem_post(&w->wake);
+}
+
+struct job *
+worker_peek(const int wait)
+{
+	struct worker	*const w = &workers[collected % WorkerCount];
+
+	if (collected == dispatched)
+		return NULL;
+
+	while (__atomic_load_n(&w->done, __ATOMIC_ACQUIRE) == w->head) {
+		if (!wait)
+			return NULL;
+		sched_yield();
+	}
+
+	return &w->jobs[w->head & (WorkerSlots - 1)];
+}
+
+void
+worker_drop(void)
+{
+	++workers[collected++ % WorkerCount].head;
+}
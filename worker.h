@@ -0,0 +1,14 @@
+#ifdef USE_THREADS
+/* worker_start: start the crypto workers */
+int		 worker_start(void);
+
+/* worker_send: seal a datagram on a worker, datagrams leave in order */
+void		 worker_send(int, const uint8_t *, size_t,
+		    const struct addrinfo *, const struct timespec *);
+
+/* worker_recv: read a burst of datagrams and open them on the workers */
+void		 worker_recv(int);
+
+/* worker_next: next authentic datagram of the burst, its mark and source */
+const uint8_t	*worker_next(size_t *, int *, struct sockaddr_storage *);
+#endif